@@ -0,0 +1,368 @@
+#include "audio.h"
+#include "frame-clock.h"
+
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+extern "C"
+{
+#include <libavutil/channel_layout.h>
+#include <libavutil/mathematics.h>
+}
+
+// larger gaps between the sample count and the capture clock resync the audio timeline
+static const int64_t max_audio_drift_us = 200000;
+
+static void set_channel_layout(AVCodecContext *codec_ctx, int channels)
+{
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+  av_channel_layout_default(&codec_ctx->ch_layout, channels);
+#else
+  codec_ctx->channels = channels;
+  codec_ctx->channel_layout = av_get_default_channel_layout(channels);
+#endif
+}
+
+static void wait_until_us(int64_t deadline_us)
+{
+  int64_t now = monotonic_time_us();
+  if (deadline_us > now)
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(deadline_us - now));
+  }
+}
+
+tone_source::tone_source(int sample_rate, int channels, double frequency)
+    : sample_rate(sample_rate), channels(channels), frequency(frequency), start_us(monotonic_time_us()), samples_read(0)
+{
+}
+
+bool tone_source::read(uint8_t **planes, int nb_samples, int64_t &timestamp_us)
+{
+  timestamp_us = start_us + av_rescale(samples_read, 1000000, sample_rate);
+  wait_until_us(start_us + av_rescale(samples_read + nb_samples, 1000000, sample_rate));
+
+  for (int c = 0; c < channels; c++)
+  {
+    float *samples = reinterpret_cast<float *>(planes[c]);
+    for (int i = 0; i < nb_samples; i++)
+    {
+      samples[i] = 0.2f * static_cast<float>(std::sin(2 * M_PI * frequency * (samples_read + i) / sample_rate));
+    }
+  }
+
+  samples_read += nb_samples;
+  return true;
+}
+
+device_audio_source::device_audio_source(const std::string &format, const std::string &url, int sample_rate, int channels)
+    : fmt_ctx(nullptr), dec_ctx(nullptr), swr(nullptr), fifo(nullptr), decoded(av_frame_alloc()), stream_index(-1), sample_rate(sample_rate),
+      channels(channels), realtime(format.empty()), start_us(0), samples_read(0), converted(channels)
+{
+  const AVInputFormat *input_format = nullptr;
+  AVDictionary *options = nullptr;
+  if (!format.empty())
+  {
+    input_format = av_find_input_format(format.c_str());
+    if (!input_format)
+    {
+      std::cout << "Unknown audio input format " << format << "!" << std::endl;
+      exit(1);
+    }
+
+    av_dict_set_int(&options, "sample_rate", sample_rate, 0);
+    av_dict_set_int(&options, "channels", channels, 0);
+  }
+
+  int ret = avformat_open_input(&fmt_ctx, url.c_str(), const_cast<AVInputFormat *>(input_format), &options);
+  av_dict_free(&options);
+  if (ret < 0)
+  {
+    std::cout << "Could not open audio input " << url << "!" << std::endl;
+    exit(1);
+  }
+
+  if (avformat_find_stream_info(fmt_ctx, nullptr) < 0)
+  {
+    std::cout << "Could not read audio stream info!" << std::endl;
+    exit(1);
+  }
+
+  stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+  if (stream_index < 0)
+  {
+    std::cout << "No audio stream in " << url << "!" << std::endl;
+    exit(1);
+  }
+
+  const AVCodec *decoder = avcodec_find_decoder(fmt_ctx->streams[stream_index]->codecpar->codec_id);
+  if (!decoder)
+  {
+    std::cout << "No decoder for the audio stream in " << url << "!" << std::endl;
+    exit(1);
+  }
+
+  dec_ctx = avcodec_alloc_context3(decoder);
+  avcodec_parameters_to_context(dec_ctx, fmt_ctx->streams[stream_index]->codecpar);
+  if (avcodec_open2(dec_ctx, decoder, nullptr) < 0)
+  {
+    std::cout << "Could not open audio decoder!" << std::endl;
+    exit(1);
+  }
+
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+  AVChannelLayout out_layout;
+  av_channel_layout_default(&out_layout, channels);
+  swr_alloc_set_opts2(&swr, &out_layout, AV_SAMPLE_FMT_FLTP, sample_rate, &dec_ctx->ch_layout, dec_ctx->sample_fmt, dec_ctx->sample_rate, 0, nullptr);
+#else
+  int64_t in_layout = dec_ctx->channel_layout ? dec_ctx->channel_layout : av_get_default_channel_layout(dec_ctx->channels);
+  swr = swr_alloc_set_opts(nullptr, av_get_default_channel_layout(channels), AV_SAMPLE_FMT_FLTP, sample_rate, in_layout, dec_ctx->sample_fmt,
+                           dec_ctx->sample_rate, 0, nullptr);
+#endif
+  if (!swr || swr_init(swr) < 0)
+  {
+    std::cout << "Could not initialize audio resampler!" << std::endl;
+    exit(1);
+  }
+
+  fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, channels, sample_rate);
+  start_us = monotonic_time_us();
+}
+
+device_audio_source::~device_audio_source()
+{
+  av_audio_fifo_free(fifo);
+  swr_free(&swr);
+  av_frame_free(&decoded);
+  avcodec_free_context(&dec_ctx);
+  avformat_close_input(&fmt_ctx);
+}
+
+bool device_audio_source::decode_more()
+{
+  AVPacket pkt = {0};
+  int ret = av_read_frame(fmt_ctx, &pkt);
+  if (ret == AVERROR_EOF && realtime)
+  {
+    // files loop forever so they behave like a live input
+    av_seek_frame(fmt_ctx, stream_index, 0, 0);
+    avcodec_flush_buffers(dec_ctx);
+    return true;
+  }
+  if (ret < 0)
+  {
+    return false;
+  }
+
+  if (pkt.stream_index == stream_index)
+  {
+    ret = avcodec_send_packet(dec_ctx, &pkt);
+    while (ret >= 0)
+    {
+      ret = avcodec_receive_frame(dec_ctx, decoded);
+      if (ret < 0)
+      {
+        break;
+      }
+
+      int out_samples = swr_get_out_samples(swr, decoded->nb_samples);
+      std::vector<uint8_t *> out(channels);
+      for (int c = 0; c < channels; c++)
+      {
+        converted[c].resize(out_samples);
+        out[c] = reinterpret_cast<uint8_t *>(converted[c].data());
+      }
+
+      int n = swr_convert(swr, out.data(), out_samples, const_cast<const uint8_t **>(decoded->extended_data), decoded->nb_samples);
+      if (n > 0)
+      {
+        av_audio_fifo_write(fifo, reinterpret_cast<void **>(out.data()), n);
+      }
+      av_frame_unref(decoded);
+    }
+  }
+
+  av_packet_unref(&pkt);
+  return true;
+}
+
+bool device_audio_source::read(uint8_t **planes, int nb_samples, int64_t &timestamp_us)
+{
+  while (av_audio_fifo_size(fifo) < nb_samples)
+  {
+    if (!decode_more())
+    {
+      return false;
+    }
+  }
+
+  if (realtime)
+  {
+    timestamp_us = start_us + av_rescale(samples_read, 1000000, sample_rate);
+    wait_until_us(start_us + av_rescale(samples_read + nb_samples, 1000000, sample_rate));
+  }
+  else
+  {
+    // whatever is still buffered was captured before the samples handed out now
+    timestamp_us = monotonic_time_us() - av_rescale(av_audio_fifo_size(fifo), 1000000, sample_rate);
+  }
+
+  av_audio_fifo_read(fifo, reinterpret_cast<void **>(planes), nb_samples);
+  samples_read += nb_samples;
+  return true;
+}
+
+audio_source *create_audio_source(const std::string &spec, int sample_rate, int channels)
+{
+  if (spec.empty() || spec == "none")
+  {
+    return nullptr;
+  }
+  if (spec == "tone")
+  {
+    return new tone_source(sample_rate, channels, 440.0);
+  }
+
+  size_t colon = spec.find(':');
+  std::string kind = spec.substr(0, colon);
+  std::string target = colon == std::string::npos ? "default" : spec.substr(colon + 1);
+  if (kind == "alsa" || kind == "pulse")
+  {
+    return new device_audio_source(kind, target, sample_rate, channels);
+  }
+  if (kind == "file")
+  {
+    return new device_audio_source("", target, sample_rate, channels);
+  }
+
+  std::cout << "Unknown audio source " << spec << "!" << std::endl;
+  exit(1);
+}
+
+audio_encoder::audio_encoder(AVFormatContext *fmt_ctx, int sample_rate, int channels, int bitrate)
+    : codec_ctx(nullptr), stream(nullptr), source(nullptr), epoch_us(0), running(false)
+{
+  const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+  if (!codec)
+  {
+    std::cout << "Could not find AAC encoder!" << std::endl;
+    exit(1);
+  }
+
+  stream = avformat_new_stream(fmt_ctx, codec);
+  codec_ctx = avcodec_alloc_context3(codec);
+  codec_ctx->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+  codec_ctx->sample_rate = sample_rate;
+  codec_ctx->bit_rate = bitrate;
+  codec_ctx->time_base = {1, sample_rate};
+  set_channel_layout(codec_ctx, channels);
+  if (fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+  {
+    codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  if (avcodec_open2(codec_ctx, codec, nullptr) < 0)
+  {
+    std::cout << "Could not open audio encoder!" << std::endl;
+    exit(1);
+  }
+
+  if (avcodec_parameters_from_context(stream->codecpar, codec_ctx) < 0)
+  {
+    std::cout << "Could not initialize audio stream codec parameters!" << std::endl;
+    exit(1);
+  }
+  stream->time_base = codec_ctx->time_base;
+}
+
+audio_encoder::~audio_encoder()
+{
+  stop();
+  avcodec_free_context(&codec_ctx);
+}
+
+void audio_encoder::start(audio_source *source, int64_t epoch_us, packet_sink sink)
+{
+  this->source = source;
+  this->epoch_us = epoch_us;
+  this->sink = sink;
+  running = true;
+  encoder = std::thread(&audio_encoder::encode_loop, this);
+}
+
+void audio_encoder::stop()
+{
+  running = false;
+  if (encoder.joinable())
+  {
+    encoder.join();
+  }
+}
+
+void audio_encoder::encode(AVFrame *frame)
+{
+  int ret = avcodec_send_frame(codec_ctx, frame);
+  while (ret >= 0)
+  {
+    AVPacket pkt = {0};
+    ret = avcodec_receive_packet(codec_ctx, &pkt);
+    if (ret < 0)
+    {
+      break;
+    }
+
+    sink(&pkt);
+    av_packet_unref(&pkt);
+  }
+}
+
+void audio_encoder::encode_loop()
+{
+  AVFrame *frame = av_frame_alloc();
+  frame->nb_samples = codec_ctx->frame_size;
+  frame->format = codec_ctx->sample_fmt;
+  frame->sample_rate = codec_ctx->sample_rate;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+  av_channel_layout_copy(&frame->ch_layout, &codec_ctx->ch_layout);
+#else
+  frame->channels = codec_ctx->channels;
+  frame->channel_layout = codec_ctx->channel_layout;
+#endif
+  if (av_frame_get_buffer(frame, 0) < 0)
+  {
+    std::cout << "Could not allocate audio frame!" << std::endl;
+    exit(1);
+  }
+
+  int64_t next_pts = AV_NOPTS_VALUE;
+  int64_t max_drift = av_rescale(max_audio_drift_us, codec_ctx->sample_rate, 1000000);
+  while (running)
+  {
+    av_frame_make_writable(frame);
+
+    int64_t timestamp_us;
+    if (!source->read(frame->extended_data, frame->nb_samples, timestamp_us))
+    {
+      std::cout << "Could not read audio samples!" << std::endl;
+      break;
+    }
+
+    // count samples so the encoder sees a gapless timeline, and only jump forward when the
+    // capture clock says samples were lost
+    int64_t pts = av_rescale_q(timestamp_us - epoch_us, {1, 1000000}, codec_ctx->time_base);
+    if (next_pts == AV_NOPTS_VALUE || pts - next_pts > max_drift)
+    {
+      next_pts = std::max<int64_t>(pts, next_pts == AV_NOPTS_VALUE ? 0 : next_pts);
+    }
+
+    frame->pts = next_pts;
+    next_pts += frame->nb_samples;
+    encode(frame);
+  }
+
+  encode(nullptr);
+  av_frame_free(&frame);
+}
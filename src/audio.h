@@ -0,0 +1,104 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
+#include <libswresample/swresample.h>
+}
+
+// a live source of planar float samples at the encoder sample rate and channel count
+class audio_source
+{
+public:
+  virtual ~audio_source() {}
+
+  // blocks until nb_samples per channel are available, the timestamp is the monotonic capture
+  // time of the first sample in microseconds
+  virtual bool read(uint8_t **planes, int nb_samples, int64_t &timestamp_us) = 0;
+};
+
+// a sine tone paced in real time, for testing without a capture device
+class tone_source : public audio_source
+{
+public:
+  tone_source(int sample_rate, int channels, double frequency);
+
+  bool read(uint8_t **planes, int nb_samples, int64_t &timestamp_us) override;
+
+private:
+  int sample_rate;
+  int channels;
+  double frequency;
+  int64_t start_us;
+  int64_t samples_read;
+};
+
+// anything libavformat can open: an alsa or pulse device through libavdevice, or a file that is
+// looped and played back in real time
+class device_audio_source : public audio_source
+{
+public:
+  device_audio_source(const std::string &format, const std::string &url, int sample_rate, int channels);
+  ~device_audio_source();
+
+  bool read(uint8_t **planes, int nb_samples, int64_t &timestamp_us) override;
+
+private:
+  bool decode_more();
+
+  AVFormatContext *fmt_ctx;
+  AVCodecContext *dec_ctx;
+  SwrContext *swr;
+  AVAudioFifo *fifo;
+  AVFrame *decoded;
+  int stream_index;
+  int sample_rate;
+  int channels;
+  bool realtime;
+  int64_t start_us;
+  int64_t samples_read;
+  std::vector<std::vector<float>> converted;
+};
+
+// parses none | tone | alsa:<device> | pulse:<device> | file:<path>, returns nullptr for none
+audio_source *create_audio_source(const std::string &spec, int sample_rate, int channels);
+
+// an aac stream next to the video stream, encoded on its own thread so it never holds up video
+class audio_encoder
+{
+public:
+  typedef std::function<void(AVPacket *)> packet_sink;
+
+  // adds the stream to fmt_ctx, so it has to be created before the header is written
+  audio_encoder(AVFormatContext *fmt_ctx, int sample_rate, int channels, int bitrate);
+  ~audio_encoder();
+
+  // timestamps are taken relative to epoch_us, the same origin the video clock uses
+  void start(audio_source *source, int64_t epoch_us, packet_sink sink);
+  void stop();
+
+  AVCodecContext *codec_ctx;
+  AVStream *stream;
+
+private:
+  void encode_loop();
+  void encode(AVFrame *frame);
+
+  audio_source *source;
+  packet_sink sink;
+  int64_t epoch_us;
+  std::atomic<bool> running;
+  std::thread encoder;
+};
+
+#endif
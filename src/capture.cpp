@@ -0,0 +1,345 @@
+#include "capture.h"
+#include "frame-clock.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+// a capture thread stuck in the driver for longer than this is left behind when reopening
+static const int64_t max_release_wait_us = 1000000;
+
+device_source::device_source(cv::VideoCapture cam, bool device_timestamps) : cam(cam), device_timestamps(device_timestamps)
+{
+}
+
+bool device_source::read(cv::Mat &image, int64_t &timestamp_us)
+{
+  cam >> image;
+  timestamp_us = device_timestamps ? static_cast<int64_t>(cam.get(cv::CAP_PROP_POS_MSEC) * 1000) : monotonic_time_us();
+  return !image.empty();
+}
+
+void device_source::set_size(double width, double height)
+{
+  cam.set(cv::CAP_PROP_FRAME_WIDTH, width);
+  cam.set(cv::CAP_PROP_FRAME_HEIGHT, height);
+}
+
+void device_source::set_fps(double fps)
+{
+  cam.set(cv::CAP_PROP_FPS, fps);
+}
+
+latest_frame_source::latest_frame_source(cv::VideoCapture cam, bool device_timestamps)
+    : cam(cam), device_timestamps(device_timestamps), reader_waiting(false), running(true), grabbed_seq(0), retrieved_seq(0),
+      grabbed_at_us(0), retrieved_count(0)
+{
+  // keep as little as possible queued in the driver, whatever sits there is already stale
+  this->cam.set(cv::CAP_PROP_BUFFERSIZE, 1);
+  grabber = std::thread(&latest_frame_source::grab_loop, this);
+}
+
+latest_frame_source::~latest_frame_source()
+{
+  {
+    std::lock_guard<std::mutex> l(lock);
+    running = false;
+  }
+  frame_grabbed.notify_all();
+  frame_retrieved.notify_all();
+  grabber.join();
+}
+
+void latest_frame_source::grab_loop()
+{
+  // VideoCapture is not thread safe, so the device is only touched with the lock held and the
+  // lock is handed over to the reader between two grabs
+  std::unique_lock<std::mutex> l(lock);
+  while (running)
+  {
+    if (cam.grab())
+    {
+      grabbed_at_us = monotonic_time_us();
+      grabbed_seq++;
+      frame_grabbed.notify_one();
+      frame_retrieved.wait(l, [this] { return !reader_waiting || !running; });
+    }
+    else
+    {
+      // keep trying, a waiting reader gives up on its own
+      l.unlock();
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      l.lock();
+    }
+  }
+}
+
+bool latest_frame_source::read(cv::Mat &image, int64_t &timestamp_us)
+{
+  reader_waiting = true;
+  std::unique_lock<std::mutex> l(lock);
+  bool grabbed = frame_grabbed.wait_for(l, std::chrono::seconds(1), [this] { return grabbed_seq != retrieved_seq || !running; });
+
+  bool ok = grabbed && running && cam.retrieve(image) && !image.empty();
+  timestamp_us = device_timestamps ? static_cast<int64_t>(cam.get(cv::CAP_PROP_POS_MSEC) * 1000) : grabbed_at_us;
+  retrieved_seq = grabbed_seq;
+  if (ok)
+  {
+    retrieved_count++;
+  }
+
+  reader_waiting = false;
+  l.unlock();
+  frame_retrieved.notify_one();
+
+  return ok;
+}
+
+void latest_frame_source::set_size(double width, double height)
+{
+  reader_waiting = true;
+  {
+    std::lock_guard<std::mutex> l(lock);
+    cam.set(cv::CAP_PROP_FRAME_WIDTH, width);
+    cam.set(cv::CAP_PROP_FRAME_HEIGHT, height);
+    reader_waiting = false;
+  }
+  frame_retrieved.notify_one();
+}
+
+void latest_frame_source::set_fps(double fps)
+{
+  reader_waiting = true;
+  {
+    std::lock_guard<std::mutex> l(lock);
+    cam.set(cv::CAP_PROP_FPS, fps);
+    reader_waiting = false;
+  }
+  frame_retrieved.notify_one();
+}
+
+uint64_t latest_frame_source::skipped() const
+{
+  std::lock_guard<std::mutex> l(lock);
+  return grabbed_seq - retrieved_count;
+}
+
+watchdog_source::watchdog_source(factory open, int64_t timeout_us)
+    : open(open), timeout_us(timeout_us), shared(new state()), running(true), read_seq(0), read_count(0)
+{
+  start(open());
+  watcher = std::thread(&watchdog_source::watch, this);
+}
+
+watchdog_source::~watchdog_source()
+{
+  {
+    std::lock_guard<std::mutex> l(stop_lock);
+    running = false;
+  }
+  stop.notify_all();
+  watcher.join();
+
+  // the capture thread finishes on its own, it may be stuck in the driver for good
+  current->abandoned = true;
+}
+
+void watchdog_source::start(frame_source *source)
+{
+  bool reopen = current != nullptr;
+  current = std::make_shared<run>();
+  current->source.reset(source);
+  current->abandoned = false;
+  {
+    std::lock_guard<std::mutex> l(shared->lock);
+    current->reopen = reopen;
+    // a fresh source gets the full timeout to deliver its first frame
+    shared->last_frame_us = monotonic_time_us();
+  }
+  std::thread(&watchdog_source::capture_loop, shared, current).detach();
+}
+
+void watchdog_source::capture_loop(std::shared_ptr<state> shared, std::shared_ptr<run> current)
+{
+  uint64_t applied = 0;
+  cv::Mat image;
+  while (!current->abandoned)
+  {
+    double width = 0, height = 0, fps = 0;
+    {
+      std::lock_guard<std::mutex> l(shared->lock);
+      if (shared->settings != applied)
+      {
+        applied = shared->settings;
+        width = shared->width;
+        height = shared->height;
+        fps = shared->fps;
+      }
+    }
+    // the device is only ever touched from this thread
+    if (width > 0 && height > 0)
+    {
+      current->source->set_size(width, height);
+    }
+    if (fps > 0)
+    {
+      current->source->set_fps(fps);
+    }
+
+    int64_t timestamp_us;
+    bool ok = current->source->read(image, timestamp_us);
+
+    std::lock_guard<std::mutex> l(shared->lock);
+    if (current->abandoned)
+    {
+      break;
+    }
+    if (ok && !image.empty() && !current->delivered)
+    {
+      // a reopen only counts once the camera is back
+      current->delivered = true;
+      shared->reopens += current->reopen;
+    }
+    // empty frames do not count, a source that only delivers those stalls just the same
+    if (ok && !image.empty())
+    {
+      shared->frame = image;
+      shared->timestamp_us = timestamp_us;
+      shared->seq++;
+      shared->last_frame_us = monotonic_time_us();
+      shared->online = true;
+      shared->delivered.notify_one();
+      // the reader holds on to the handed out buffer, the next frame goes into a new one
+      image = cv::Mat();
+    }
+  }
+
+  // the device is closed here, the watchdog waits for it before opening the camera again
+  current->source.reset();
+  std::lock_guard<std::mutex> l(shared->lock);
+  current->released = true;
+  shared->released.notify_all();
+}
+
+void watchdog_source::watch()
+{
+  int64_t backoff_ms = 100;
+  bool open_failed = false;
+  std::unique_lock<std::mutex> l(stop_lock);
+  while (running)
+  {
+    stop.wait_for(l, std::chrono::milliseconds(100));
+    if (!running)
+    {
+      break;
+    }
+
+    bool stalled;
+    {
+      std::lock_guard<std::mutex> sl(shared->lock);
+      stalled = monotonic_time_us() - shared->last_frame_us > timeout_us;
+      if (stalled && shared->online)
+      {
+        shared->online = false;
+        std::cout << "Camera stalled, reopening it" << std::endl;
+      }
+    }
+    if (!stalled)
+    {
+      continue;
+    }
+
+    // the old capture thread closes the device once its read returns, until then opening it again
+    // would only fail with EBUSY. one that hangs in the driver for good is left behind
+    std::shared_ptr<run> old = current;
+    old->abandoned = true;
+    l.unlock();
+    bool retry;
+    {
+      std::unique_lock<std::mutex> sl(shared->lock);
+      shared->released.wait_for(sl, std::chrono::microseconds(std::min(timeout_us, max_release_wait_us)), [&old] { return old->released; });
+      // a camera that could not be opened or never delivered after a reopen is tried again after a
+      // growing pause
+      retry = open_failed || (old->reopen && !old->delivered);
+    }
+    if (retry)
+    {
+      l.lock();
+      stop.wait_for(l, std::chrono::milliseconds(backoff_ms));
+      backoff_ms = std::min<int64_t>(backoff_ms * 2, 5000);
+      if (!running)
+      {
+        break;
+      }
+      l.unlock();
+    }
+    else
+    {
+      backoff_ms = 100;
+    }
+    frame_source *source = nullptr;
+    try
+    {
+      source = open();
+    }
+    catch (const std::exception &e)
+    {
+      std::cout << e.what() << std::endl;
+    }
+    l.lock();
+
+    open_failed = !source;
+    if (source)
+    {
+      start(source);
+    }
+  }
+}
+
+bool watchdog_source::read(cv::Mat &image, int64_t &timestamp_us)
+{
+  std::unique_lock<std::mutex> l(shared->lock);
+  if (!shared->delivered.wait_for(l, std::chrono::milliseconds(100), [this] { return shared->seq != read_seq; }))
+  {
+    return false;
+  }
+
+  image = shared->frame;
+  timestamp_us = shared->timestamp_us;
+  read_seq = shared->seq;
+  read_count++;
+  return true;
+}
+
+void watchdog_source::set_size(double width, double height)
+{
+  std::lock_guard<std::mutex> l(shared->lock);
+  shared->width = width;
+  shared->height = height;
+  shared->settings++;
+}
+
+void watchdog_source::set_fps(double fps)
+{
+  std::lock_guard<std::mutex> l(shared->lock);
+  shared->fps = fps;
+  shared->settings++;
+}
+
+uint64_t watchdog_source::skipped() const
+{
+  std::lock_guard<std::mutex> l(shared->lock);
+  return shared->seq - read_count;
+}
+
+uint64_t watchdog_source::reopens() const
+{
+  std::lock_guard<std::mutex> l(shared->lock);
+  return shared->reopens;
+}
+
+bool watchdog_source::offline() const
+{
+  std::lock_guard<std::mutex> l(shared->lock);
+  return !shared->online;
+}
@@ -0,0 +1,147 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <opencv2/videoio.hpp>
+
+// a source of BGR frames for the encoder loop
+class frame_source
+{
+public:
+  virtual ~frame_source() {}
+
+  // blocks until the next frame is available, returns false if none could be read. the timestamp is
+  // the monotonic capture time in microseconds, or the device timestamp when the source reports those
+  virtual bool read(cv::Mat &image, int64_t &timestamp_us) = 0;
+
+  // asks the device for a new capture size, the frames delivered afterwards may or may not match it
+  virtual void set_size(double width, double height) = 0;
+
+  // asks the device for another frame rate
+  virtual void set_fps(double fps) = 0;
+
+  // frames the device delivered that never reached the encoder
+  virtual uint64_t skipped() const { return 0; }
+};
+
+// reads frames in driver queue order, the way `cam >> image` does
+class device_source : public frame_source
+{
+public:
+  device_source(cv::VideoCapture cam, bool device_timestamps);
+
+  bool read(cv::Mat &image, int64_t &timestamp_us) override;
+  void set_size(double width, double height) override;
+  void set_fps(double fps) override;
+
+private:
+  cv::VideoCapture cam;
+  bool device_timestamps;
+};
+
+// keeps grabbing on its own thread and only decodes the newest frame when the encoder asks for one,
+// frames grabbed in between are dropped without ever being decoded or converted
+class latest_frame_source : public frame_source
+{
+public:
+  latest_frame_source(cv::VideoCapture cam, bool device_timestamps);
+  ~latest_frame_source();
+
+  bool read(cv::Mat &image, int64_t &timestamp_us) override;
+  void set_size(double width, double height) override;
+  void set_fps(double fps) override;
+  uint64_t skipped() const override;
+
+private:
+  void grab_loop();
+
+  cv::VideoCapture cam;
+  bool device_timestamps;
+  std::thread grabber;
+  mutable std::mutex lock;
+  std::condition_variable frame_grabbed;
+  std::condition_variable frame_retrieved;
+  std::atomic<bool> reader_waiting;
+  bool running;
+  uint64_t grabbed_seq;
+  uint64_t retrieved_seq;
+  int64_t grabbed_at_us;
+  std::atomic<uint64_t> retrieved_count;
+};
+
+// runs another source on a thread of its own and watches it. a source that hangs in the driver or only
+// delivers empty frames is abandoned and reopened in the background, until then read reports the
+// camera offline instead of blocking
+class watchdog_source : public frame_source
+{
+public:
+  typedef std::function<frame_source *()> factory;
+
+  // opens the first source right away, timeout_us without a frame counts as a stall
+  watchdog_source(factory open, int64_t timeout_us);
+  ~watchdog_source();
+
+  // waits for a frame at most a tenth of a second, so the caller can fill in while the camera is away
+  bool read(cv::Mat &image, int64_t &timestamp_us) override;
+  void set_size(double width, double height) override;
+  void set_fps(double fps) override;
+  uint64_t skipped() const override;
+
+  bool offline() const;
+  // reopened cameras that delivered a frame again
+  uint64_t reopens() const;
+
+private:
+  // shared with capture threads that may outlive the watchdog while they hang in the driver
+  struct state
+  {
+    std::mutex lock;
+    std::condition_variable delivered;
+    // an abandoned capture thread has let go of its device
+    std::condition_variable released;
+    cv::Mat frame;
+    int64_t timestamp_us = 0;
+    uint64_t seq = 0;
+    int64_t last_frame_us = 0;
+    bool online = true;
+    double width = 0;
+    double height = 0;
+    double fps = 0;
+    uint64_t settings = 0;
+    uint64_t reopens = 0;
+  };
+
+  struct run
+  {
+    std::unique_ptr<frame_source> source;
+    std::atomic<bool> abandoned;
+    // guarded by the state's lock
+    bool reopen = false;
+    bool delivered = false;
+    bool released = false;
+  };
+
+  static void capture_loop(std::shared_ptr<state> shared, std::shared_ptr<run> current);
+  void start(frame_source *source);
+  void watch();
+
+  factory open;
+  int64_t timeout_us;
+  std::shared_ptr<state> shared;
+  std::shared_ptr<run> current;
+  std::thread watcher;
+  std::mutex stop_lock;
+  std::condition_variable stop;
+  bool running;
+  uint64_t read_seq;
+  uint64_t read_count;
+};
+
+#endif
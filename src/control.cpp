@@ -0,0 +1,347 @@
+#include "control.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// clients are served one at a time, one that sends nothing for this long is dropped so it cannot
+// block everyone else
+static const int client_idle_timeout_ms = 5000;
+// requests every pipeline has seen are dropped, and a pipeline that stopped polling cannot hold on
+// to more than this many
+static const size_t max_queued_requests = 256;
+
+static const char *usage = "commands: bitrate <b/s> [maxrate] [bufsize] | keyframe | fps <fps> | pause | resume | add <url> | remove <url> | clip <from> <to> <path> | stats, "
+                           "prefixed with @<camera> to address one camera";
+
+static std::string percent_decode(const std::string &s)
+{
+  std::string out;
+  for (size_t i = 0; i < s.size(); i++)
+  {
+    if (s[i] == '%' && i + 2 < s.size())
+    {
+      out += static_cast<char>(strtol(s.substr(i + 1, 2).c_str(), nullptr, 16));
+      i += 2;
+    }
+    else
+    {
+      out += s[i];
+    }
+  }
+  return out;
+}
+
+control_server::control_server(const std::string &address) : listener(-1), running(true), first_posted(0), posted(0)
+{
+  if (address.find('/') != std::string::npos)
+  {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+
+    // a socket left behind by an earlier run
+    unlink(address.c_str());
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+    {
+      std::cout << "Could not bind control socket " << address << "!" << std::endl;
+      exit(1);
+    }
+    path = address;
+  }
+  else
+  {
+    size_t colon = address.rfind(':');
+    std::string host = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+    int port = atoi(address.substr(colon == std::string::npos ? 0 : colon + 1).c_str());
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    int yes = 1;
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0 || inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0 || bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+    {
+      std::cout << "Could not bind control port " << address << "!" << std::endl;
+      exit(1);
+    }
+  }
+
+  if (listen(listener, 4) < 0)
+  {
+    std::cout << "Could not listen on " << address << "!" << std::endl;
+    exit(1);
+  }
+
+  server = std::thread(&control_server::serve, this);
+}
+
+control_server::~control_server()
+{
+  running = false;
+  server.join();
+  close(listener);
+  if (!path.empty())
+  {
+    unlink(path.c_str());
+  }
+}
+
+bool control_server::poll(int camera, size_t &seen, std::vector<control_request> &requests)
+{
+  // the common case, nothing new since the last frame
+  if (posted.load(std::memory_order_acquire) == seen)
+  {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> l(lock);
+  requests.clear();
+  // whatever was trimmed before this pipeline got here is gone
+  seen = std::max(seen, first_posted);
+  for (; seen < first_posted + queue.size(); seen++)
+  {
+    const control_request &r = queue[seen - first_posted];
+    if (r.camera < 0 || r.camera == camera)
+    {
+      requests.push_back(r);
+    }
+  }
+
+  positions[camera] = seen;
+  size_t oldest = seen;
+  for (const auto &p : positions)
+  {
+    oldest = std::min(oldest, p.second);
+  }
+  for (; first_posted < oldest; first_posted++)
+  {
+    queue.pop_front();
+  }
+  return !requests.empty();
+}
+
+void control_server::publish_stats(int camera, const std::string &json)
+{
+  std::lock_guard<std::mutex> l(lock);
+  stats[camera] = json;
+}
+
+void control_server::serve()
+{
+  while (running)
+  {
+    // wake up now and then to notice shutdown
+    pollfd pfd = {listener, POLLIN, 0};
+    if (::poll(&pfd, 1, 200) <= 0)
+    {
+      continue;
+    }
+
+    int client = accept(listener, nullptr, nullptr);
+    if (client >= 0)
+    {
+      // a client that stops reading cannot hold up the replies either
+      timeval timeout = {client_idle_timeout_ms / 1000, 0};
+      setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      handle_client(client);
+      close(client);
+    }
+  }
+}
+
+void control_server::handle_client(int client)
+{
+  std::string buffer;
+  char chunk[512];
+  int idle_ms = 0;
+  while (running)
+  {
+    size_t eol = buffer.find('\n');
+    if (eol == std::string::npos)
+    {
+      pollfd pfd = {client, POLLIN, 0};
+      if (::poll(&pfd, 1, 200) == 0)
+      {
+        idle_ms += 200;
+        if (idle_ms >= client_idle_timeout_ms)
+        {
+          return;
+        }
+        continue;
+      }
+      ssize_t n = read(client, chunk, sizeof(chunk));
+      if (n <= 0 || buffer.size() > 4096)
+      {
+        return;
+      }
+      buffer.append(chunk, n);
+      idle_ms = 0;
+      continue;
+    }
+
+    std::string line = buffer.substr(0, eol);
+    buffer.erase(0, eol + 1);
+    if (!line.empty() && line.back() == '\r')
+    {
+      line.pop_back();
+    }
+    if (line.empty())
+    {
+      continue;
+    }
+
+    bool ok = true;
+    size_t http = line.find(" HTTP/");
+    if (line.compare(0, 4, "GET ") == 0 && http != std::string::npos)
+    {
+      // GET /bitrate/500000 or GET /add/rtmp://host/live/key, one request per connection
+      std::string target = line.substr(5, http - 5);
+      size_t slash = target.find('/');
+      std::string command = target.substr(0, slash);
+      std::string args = slash == std::string::npos ? "" : target.substr(slash + 1);
+      if (command.compare(0, 1, "@") == 0 && slash != std::string::npos)
+      {
+        slash = args.find('/');
+        command += " " + args.substr(0, slash);
+        args = slash == std::string::npos ? "" : args.substr(slash + 1);
+      }
+      // urls and paths keep their slashes, a clip has two numbers in front of the path
+      int separators = -1;
+      if (command.find("add") != std::string::npos || command.find("remove") != std::string::npos)
+      {
+        separators = 0;
+      }
+      else if (command.find("clip") != std::string::npos)
+      {
+        separators = 2;
+      }
+      for (size_t i = 0; i < args.size() && separators != 0; i++)
+      {
+        if (args[i] == '/')
+        {
+          args[i] = ' ';
+          separators--;
+        }
+      }
+
+      std::string body = handle(percent_decode(command + " " + args), ok) + "\n";
+      std::ostringstream response;
+      response << "HTTP/1.0 " << (ok ? "200 OK" : "400 Bad Request") << "\r\nContent-Type: " << (body[0] == '{' ? "application/json" : "text/plain")
+               << "\r\nContent-Length: " << body.size() << "\r\nConnection: close\r\n\r\n"
+               << body;
+      std::string out = response.str();
+      send(client, out.data(), out.size(), MSG_NOSIGNAL);
+      return;
+    }
+
+    std::string reply = handle(line, ok) + "\n";
+    // a client that went away must not take the process down with SIGPIPE
+    if (send(client, reply.data(), reply.size(), MSG_NOSIGNAL) < 0)
+    {
+      return;
+    }
+  }
+}
+
+std::string control_server::handle(const std::string &command, bool &ok)
+{
+  std::istringstream in(command);
+  std::string name;
+  control_request r;
+  in >> name;
+  if (name.compare(0, 1, "@") == 0)
+  {
+    r.camera = atoi(name.c_str() + 1);
+    in >> name;
+  }
+
+  ok = true;
+  if (name == "stats")
+  {
+    std::lock_guard<std::mutex> l(lock);
+    std::string json = "{\"pipelines\":[";
+    for (auto it = stats.begin(); it != stats.end(); ++it)
+    {
+      if (r.camera < 0 || it->first == r.camera)
+      {
+        json += (json.back() == '[' ? "" : ",") + it->second;
+      }
+    }
+    return json + "]}";
+  }
+
+  if (name == "bitrate")
+  {
+    in >> r.bitrate;
+    if (!in || r.bitrate <= 0)
+    {
+      ok = false;
+      return "error: bitrate needs a positive value";
+    }
+    in >> r.maxrate >> r.bufsize;
+  }
+  else if (name == "fps")
+  {
+    in >> r.fps;
+    if (!in || r.fps <= 0)
+    {
+      ok = false;
+      return "error: fps needs a positive value";
+    }
+  }
+  else if (name == "keyframe")
+  {
+    r.keyframe = true;
+  }
+  else if (name == "pause" || name == "resume")
+  {
+    r.pause = name == "pause";
+  }
+  else if (name == "add" || name == "remove")
+  {
+    std::string url;
+    in >> url;
+    if (url.empty())
+    {
+      ok = false;
+      return "error: " + name + " needs an output url";
+    }
+    (name == "add" ? r.add_output : r.remove_output) = url;
+  }
+  else if (name == "clip")
+  {
+    in >> r.clip_from >> r.clip_to >> r.clip_path;
+    if (!in || r.clip_from <= r.clip_to || r.clip_to < 0)
+    {
+      ok = false;
+      return "error: clip needs seconds back to start from, seconds back to end at and an output path";
+    }
+  }
+  else
+  {
+    ok = false;
+    return std::string("error: ") + usage;
+  }
+
+  std::lock_guard<std::mutex> l(lock);
+  queue.push_back(r);
+  if (queue.size() > max_queued_requests)
+  {
+    queue.pop_front();
+    first_posted++;
+  }
+  posted.store(first_posted + queue.size(), std::memory_order_release);
+  return "ok";
+}
@@ -0,0 +1,69 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// one command from the control socket. zero and empty fields are left as they are
+struct control_request
+{
+  // camera the command is for, -1 for every pipeline
+  int camera = -1;
+  int bitrate = 0;
+  int maxrate = 0;
+  int bufsize = 0;
+  int fps = 0;
+  bool keyframe = false;
+  // 1 pauses, 0 resumes, -1 leaves it
+  int pause = -1;
+  std::string add_output;
+  std::string remove_output;
+  // seconds before now, the clip goes to clip_path
+  double clip_from = 0;
+  double clip_to = 0;
+  std::string clip_path;
+};
+
+// serves a line based protocol on a unix socket, or the same commands as GET /<command>/<args> over
+// http on a tcp port. commands are queued and every pipeline picks them up at its next frame
+// boundary, the pipelines only do an atomic load per frame while nothing changes
+class control_server
+{
+public:
+  // a path for a unix socket, [host:]port for http, the host defaults to 127.0.0.1
+  explicit control_server(const std::string &address);
+  ~control_server();
+
+  // requests for camera posted since the last call, seen is the caller's position in the queue
+  bool poll(int camera, size_t &seen, std::vector<control_request> &requests);
+
+  // latest stats of a pipeline as a json object, served by the stats command
+  void publish_stats(int camera, const std::string &json);
+
+private:
+  void serve();
+  void handle_client(int client);
+  std::string handle(const std::string &command, bool &ok);
+
+  std::string path;
+  int listener;
+  std::thread server;
+  std::atomic<bool> running;
+
+  std::mutex lock;
+  // requests are numbered from the start, the queue holds those from first_posted on
+  std::deque<control_request> queue;
+  size_t first_posted;
+  std::atomic<size_t> posted;
+  // how far every pipeline has read, by camera
+  std::map<int, size_t> positions;
+  std::map<int, std::string> stats;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include "denoise.h"
+#include "frame-clock.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// frames the filter stays off once even luma alone does not fit the budget
+static const int cooldown_frames = 100;
+
+// out = prev + (cur - prev) * w / 128, with w = weight where |cur - prev| <= threshold and 128 (no
+// filtering) where the pixel moved. prev is updated in place and becomes the next reference
+static void filter_row(uint8_t *cur, uint8_t *prev, int n, int weight, int threshold)
+{
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i thresh = _mm_set1_epi16(threshold);
+  const __m128i still = _mm_set1_epi16(weight);
+  const __m128i moving = _mm_set1_epi16(128);
+  const __m128i round = _mm_set1_epi16(64);
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cur + i));
+    __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(prev + i));
+    __m128i out[2];
+    for (int half = 0; half < 2; half++)
+    {
+      __m128i c16 = half ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+      __m128i p16 = half ? _mm_unpackhi_epi8(p, zero) : _mm_unpacklo_epi8(p, zero);
+      __m128i d = _mm_sub_epi16(c16, p16);
+      __m128i ad = _mm_max_epi16(d, _mm_sub_epi16(zero, d));
+      __m128i moved = _mm_cmpgt_epi16(ad, thresh);
+      __m128i w = _mm_or_si128(_mm_and_si128(moved, moving), _mm_andnot_si128(moved, still));
+      // |d| * w stays below 255 * 128, inside int16
+      out[half] = _mm_add_epi16(p16, _mm_srai_epi16(_mm_add_epi16(_mm_mullo_epi16(d, w), round), 7));
+    }
+
+    __m128i result = _mm_packus_epi16(out[0], out[1]);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(cur + i), result);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(prev + i), result);
+  }
+#endif
+  for (; i < n; i++)
+  {
+    int d = cur[i] - prev[i];
+    int w = std::abs(d) > threshold ? 128 : weight;
+    int out = prev[i] + ((d * w + 64) >> 7);
+    cur[i] = prev[i] = static_cast<uint8_t>(std::max(0, std::min(255, out)));
+  }
+}
+
+temporal_denoiser::temporal_denoiser(int strength, int slices, int64_t budget_us, work_stealing_pool *pool, size_t pipeline)
+    : budget_us(budget_us), slices(std::max(1, slices)), width(0), height(0), planes(3), cooldown(0), pool(pool), pipeline(pipeline), frames(0),
+      overruns(0), total_us(0)
+{
+  strength = std::max(1, std::min(10, strength));
+  weight = 128 - strength * 10;
+  threshold = 2 + strength * 2;
+}
+
+void temporal_denoiser::apply(AVFrame *frame)
+{
+  if (frame->width != width || frame->height != height)
+  {
+    // the first frame at a new size only seeds the reference
+    width = frame->width;
+    height = frame->height;
+    for (int p = 0; p < 3; p++)
+    {
+      int w = p ? (width + 1) / 2 : width;
+      int h = p ? (height + 1) / 2 : height;
+      previous[p].resize(w * h);
+      for (int row = 0; row < h; row++)
+      {
+        memcpy(&previous[p][row * w], frame->data[p] + row * frame->linesize[p], w);
+      }
+    }
+    return;
+  }
+
+  if (cooldown > 0)
+  {
+    if (--cooldown == 0)
+    {
+      planes = 3;
+    }
+    return;
+  }
+
+  int64_t started = monotonic_time_us();
+  int active = planes;
+  pool->parallel_for(pipeline, slices, [&](int index) {
+    for (int p = 0; p < active; p++)
+    {
+      int w = p ? (width + 1) / 2 : width;
+      int h = p ? (height + 1) / 2 : height;
+      int first = h * index / slices;
+      int last = h * (index + 1) / slices;
+      for (int row = first; row < last; row++)
+      {
+        filter_row(frame->data[p] + row * frame->linesize[p], &previous[p][row * w], w, weight, threshold);
+      }
+    }
+  });
+
+  int64_t cost = monotonic_time_us() - started;
+  frames++;
+  total_us += cost;
+
+  // over budget: drop the chroma planes first, then pause altogether. the chroma references go stale
+  // meanwhile, which is harmless since anything that moved passes through unfiltered
+  if (budget_us > 0 && cost > budget_us)
+  {
+    overruns++;
+    if (planes > 1)
+    {
+      planes = 1;
+    }
+    else
+    {
+      cooldown = cooldown_frames;
+    }
+  }
+}
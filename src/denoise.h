@@ -0,0 +1,50 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "thread-pool.h"
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+// motion adaptive recursive filter on the yuv420p planes: pixels that barely changed since the last
+// output are pulled towards it, anything that moved more than the threshold passes through as is.
+// rows are split into slices that run in parallel on the pool
+class temporal_denoiser
+{
+public:
+  // strength 1-10, budget_us is the per-frame cost it may take before it starts cutting corners
+  temporal_denoiser(int strength, int slices, int64_t budget_us, work_stealing_pool *pool, size_t pipeline);
+
+  void apply(AVFrame *frame);
+
+  uint64_t filtered() const { return frames; }
+  uint64_t over_budget() const { return overruns; }
+  int64_t average_cost_us() const { return frames ? total_us / static_cast<int64_t>(frames) : 0; }
+
+private:
+  int weight;
+  int threshold;
+  int64_t budget_us;
+  int slices;
+
+  int width;
+  int height;
+  std::vector<uint8_t> previous[3];
+  // 3 filters every plane, 1 only luma. cooldown counts down the frames the filter is paused for
+  int planes;
+  int cooldown;
+
+  work_stealing_pool *pool;
+  size_t pipeline;
+
+  uint64_t frames;
+  uint64_t overruns;
+  int64_t total_us;
+};
+
+#endif
@@ -0,0 +1,317 @@
+#include "dvr.h"
+#include "frame-clock.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+dvr_ring::dvr_ring(int seconds, size_t capacity, const std::string &path)
+    : window_us(seconds * 1000000LL), capacity(capacity), data(nullptr), fd(-1), version(0), first_seq(0), head(0)
+{
+  if (path.empty())
+  {
+    memory.resize(capacity);
+    data = memory.data();
+    return;
+  }
+
+  // only the packet bytes go to the file, the page cache decides when they reach the disk
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  void *mapped = MAP_FAILED;
+  if (fd >= 0 && ftruncate(fd, capacity) == 0)
+  {
+    mapped = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (mapped == MAP_FAILED)
+  {
+    std::cout << "Could not map the dvr file " << path << "!" << std::endl;
+    exit(1);
+  }
+  data = static_cast<uint8_t *>(mapped);
+}
+
+dvr_ring::~dvr_ring()
+{
+  for (stream_info &s : streams)
+  {
+    avcodec_parameters_free(&s.params);
+  }
+  for (snapshot &h : history)
+  {
+    for (stream_info &s : h.streams)
+    {
+      avcodec_parameters_free(&s.params);
+    }
+  }
+  if (fd >= 0)
+  {
+    munmap(data, capacity);
+    close(fd);
+  }
+}
+
+void dvr_ring::set_stream(int stream_index, const AVCodecContext *codec_ctx)
+{
+  std::lock_guard<std::mutex> l(lock);
+  if (static_cast<int>(streams.size()) <= stream_index)
+  {
+    streams.resize(stream_index + 1, {nullptr, {0, 1}});
+  }
+
+  stream_info &s = streams[stream_index];
+  if (!s.params)
+  {
+    s.params = avcodec_parameters_alloc();
+  }
+  avcodec_parameters_from_context(s.params, codec_ctx);
+  s.time_base = codec_ctx->time_base;
+  take_snapshot();
+}
+
+void dvr_ring::take_snapshot()
+{
+  snapshot h = {++version, {}};
+  for (const stream_info &s : streams)
+  {
+    AVCodecParameters *params = nullptr;
+    if (s.params)
+    {
+      params = avcodec_parameters_alloc();
+      avcodec_parameters_copy(params, s.params);
+    }
+    h.streams.push_back({params, s.time_base});
+  }
+  history.push_back(std::move(h));
+
+  // nothing in the ring was encoded with parameters older than the oldest entry's
+  uint64_t oldest = entries.empty() ? version : entries.front().version;
+  while (history.size() > 1 && history[1].version <= oldest)
+  {
+    for (stream_info &s : history.front().streams)
+    {
+      avcodec_parameters_free(&s.params);
+    }
+    history.pop_front();
+  }
+}
+
+void dvr_ring::evict_front()
+{
+  if (!keyframes.empty() && keyframes.front() == first_seq)
+  {
+    keyframes.pop_front();
+  }
+  entries.pop_front();
+  first_seq++;
+}
+
+void dvr_ring::add(int stream_index, const AVPacket *pkt)
+{
+  if (pkt->size <= 0 || static_cast<size_t>(pkt->size) > capacity)
+  {
+    return;
+  }
+
+  std::lock_guard<std::mutex> l(lock);
+  // the slate and reopened encoders announce their sequence headers in-band, from here on the stream
+  // is muxed with them
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+  size_t extradata_size = 0;
+#else
+  int extradata_size = 0;
+#endif
+  const uint8_t *extradata = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &extradata_size);
+  AVCodecParameters *params = stream_index < static_cast<int>(streams.size()) ? streams[stream_index].params : nullptr;
+  if (extradata && extradata_size > 0 && params &&
+      (params->extradata_size != static_cast<int>(extradata_size) || memcmp(params->extradata, extradata, extradata_size) != 0))
+  {
+    av_freep(&params->extradata);
+    params->extradata = static_cast<uint8_t *>(av_mallocz(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE));
+    memcpy(params->extradata, extradata, extradata_size);
+    params->extradata_size = static_cast<int>(extradata_size);
+    take_snapshot();
+  }
+
+  int64_t now = monotonic_time_us();
+  while (!entries.empty() && entries.front().received_us < now - window_us)
+  {
+    evict_front();
+  }
+
+  // packets are never split, one that does not fit before the end goes to the start and everything
+  // still stored behind the write position is the oldest data there is
+  size_t size = pkt->size;
+  if (head + size > capacity)
+  {
+    while (!entries.empty() && entries.front().offset >= head)
+    {
+      evict_front();
+    }
+    head = 0;
+  }
+  while (!entries.empty() && entries.front().offset >= head && entries.front().offset < head + size)
+  {
+    evict_front();
+  }
+
+  memcpy(data + head, pkt->data, size);
+  bool video = stream_index < static_cast<int>(streams.size()) && streams[stream_index].params &&
+               streams[stream_index].params->codec_type == AVMEDIA_TYPE_VIDEO;
+  if (video && (pkt->flags & AV_PKT_FLAG_KEY))
+  {
+    keyframes.push_back(first_seq + entries.size());
+  }
+  entries.push_back({head, pkt->size, stream_index, pkt->flags, pkt->pts, pkt->dts, pkt->duration, now, version});
+  head += size;
+}
+
+int dvr_ring::export_clip(int64_t from_us, int64_t to_us, const std::string &path)
+{
+  // copy the range out so the pipeline is only held up for the memcpy, not for the disk
+  std::vector<stream_info> info;
+  std::vector<AVPacket *> packets;
+  std::vector<int> packet_streams;
+  int64_t base_us = INT64_MAX;
+  {
+    std::lock_guard<std::mutex> l(lock);
+    size_t start = entries.size();
+    for (uint64_t seq : keyframes)
+    {
+      size_t i = seq - first_seq;
+      if (entries[i].received_us <= from_us || start == entries.size())
+      {
+        start = i;
+      }
+      if (entries[i].received_us > from_us)
+      {
+        break;
+      }
+    }
+
+    size_t end = start;
+    while (end < entries.size() && entries[end].received_us <= to_us)
+    {
+      end++;
+    }
+
+    // the parameters the last packet was encoded with hold from the first keyframe encoded with them
+    uint64_t clip_version = end > start ? entries[end - 1].version : version;
+    if (end > start && entries[start].version != clip_version)
+    {
+      size_t changed = end;
+      for (uint64_t seq : keyframes)
+      {
+        size_t i = seq - first_seq;
+        if (i >= start && i < end && entries[i].version == clip_version)
+        {
+          changed = i;
+          break;
+        }
+      }
+      start = changed;
+    }
+
+    for (size_t i = start; i < end; i++)
+    {
+      const entry &e = entries[i];
+      if (e.stream_index >= static_cast<int>(streams.size()) || !streams[e.stream_index].params)
+      {
+        continue;
+      }
+
+      AVPacket *pkt = av_packet_alloc();
+      av_new_packet(pkt, e.size);
+      memcpy(pkt->data, data + e.offset, e.size);
+      pkt->flags = e.flags;
+      pkt->pts = e.pts;
+      pkt->dts = e.dts;
+      pkt->duration = e.duration;
+      packets.push_back(pkt);
+      packet_streams.push_back(e.stream_index);
+      base_us = std::min(base_us, av_rescale_q(e.dts, streams[e.stream_index].time_base, {1, 1000000}));
+    }
+
+    const snapshot *clip_streams = &history.back();
+    for (const snapshot &h : history)
+    {
+      if (h.version <= clip_version)
+      {
+        clip_streams = &h;
+      }
+    }
+    for (const stream_info &s : clip_streams->streams)
+    {
+      AVCodecParameters *params = nullptr;
+      if (s.params)
+      {
+        params = avcodec_parameters_alloc();
+        avcodec_parameters_copy(params, s.params);
+      }
+      info.push_back({params, s.time_base});
+    }
+  }
+
+  AVFormatContext *ctx = nullptr;
+  std::vector<int> mapping(info.size(), -1);
+  bool ok = !packets.empty() && avformat_alloc_output_context2(&ctx, nullptr, "mp4", path.c_str()) >= 0;
+  for (size_t i = 0; ok && i < info.size(); i++)
+  {
+    if (info[i].params)
+    {
+      AVStream *stream = avformat_new_stream(ctx, nullptr);
+      avcodec_parameters_copy(stream->codecpar, info[i].params);
+      // the flv tags mean nothing to mp4
+      stream->codecpar->codec_tag = 0;
+      stream->time_base = info[i].time_base;
+      mapping[i] = stream->index;
+    }
+  }
+  ok = ok && avio_open(&ctx->pb, path.c_str(), AVIO_FLAG_WRITE) >= 0;
+  ok = ok && avformat_write_header(ctx, nullptr) >= 0;
+
+  int written = 0;
+  for (size_t i = 0; i < packets.size(); i++)
+  {
+    AVPacket *pkt = packets[i];
+    if (ok)
+    {
+      // the clip starts at 0
+      const stream_info &s = info[packet_streams[i]];
+      int64_t base = av_rescale_q(base_us, {1, 1000000}, s.time_base);
+      pkt->pts -= base;
+      pkt->dts -= base;
+      pkt->stream_index = mapping[packet_streams[i]];
+      av_packet_rescale_ts(pkt, s.time_base, ctx->streams[pkt->stream_index]->time_base);
+      if (av_interleaved_write_frame(ctx, pkt) >= 0)
+      {
+        written++;
+      }
+    }
+    av_packet_free(&pkt);
+  }
+
+  if (ok)
+  {
+    ok = av_write_trailer(ctx) >= 0;
+  }
+  if (ctx)
+  {
+    avio_closep(&ctx->pb);
+    avformat_free_context(ctx);
+  }
+  for (stream_info &s : info)
+  {
+    avcodec_parameters_free(&s.params);
+  }
+
+  return ok ? written : -1;
+}
@@ -0,0 +1,88 @@
+#ifndef DVR_H
+#define DVR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+// the last few minutes of encoded packets, kept in a byte ring in memory or in a mapped file, with an
+// index of the video keyframes. any range of it can be remuxed into a clip without re-encoding
+class dvr_ring
+{
+public:
+  // keeps at most seconds worth of packets and at most capacity bytes of them, the bytes live in the
+  // file at path if one is given
+  dvr_ring(int seconds, size_t capacity, const std::string &path);
+  ~dvr_ring();
+
+  // parameters the clips are muxed with, set again whenever an encoder is reopened
+  void set_stream(int stream_index, const AVCodecContext *codec_ctx);
+
+  // pkt is in the time base of the stream's encoder
+  void add(int stream_index, const AVPacket *pkt);
+
+  // writes what was received between from_us and to_us on the monotonic clock into an mp4 file,
+  // starting at the last keyframe before from_us. a clip spanning a change of the stream parameters,
+  // such as a resize, an encoder restart or the slate, starts at the first keyframe after the last
+  // change instead, so the whole clip decodes with the parameters it is muxed with. returns the number
+  // of packets written, -1 on failure
+  int export_clip(int64_t from_us, int64_t to_us, const std::string &path);
+
+private:
+  struct entry
+  {
+    size_t offset;
+    int size;
+    int stream_index;
+    int flags;
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+    int64_t received_us;
+    // the stream parameters the packet was encoded with
+    uint64_t version;
+  };
+
+  struct stream_info
+  {
+    AVCodecParameters *params;
+    AVRational time_base;
+  };
+
+  // the parameters of every stream from version on, until the next snapshot
+  struct snapshot
+  {
+    uint64_t version;
+    std::vector<stream_info> streams;
+  };
+
+  void evict_front();
+  void take_snapshot();
+
+  int64_t window_us;
+  size_t capacity;
+  uint8_t *data;
+  std::vector<uint8_t> memory;
+  int fd;
+
+  std::mutex lock;
+  std::vector<stream_info> streams;
+  // one for every change of streams still referenced by an entry, the newest is the current one
+  std::deque<snapshot> history;
+  uint64_t version;
+  std::deque<entry> entries;
+  // sequence numbers of the video keyframes still in the ring
+  std::deque<uint64_t> keyframes;
+  uint64_t first_seq;
+  size_t head;
+};
+
+#endif
@@ -0,0 +1,131 @@
+#include "filter.h"
+#include "stage-error.h"
+
+#include <cstdio>
+#include <cstring>
+
+extern "C"
+{
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+}
+
+filter_graph::filter_graph(const std::string &description, int width, int height, AVRational time_base, AVRational frame_rate, int threads)
+    : in_width(width), in_height(height), graph(avfilter_graph_alloc()), src(nullptr), sink(nullptr)
+{
+  // 0 lets libavfilter pick one slice thread per core
+  graph->nb_threads = threads;
+
+  char args[256];
+  snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:frame_rate=%d/%d:pixel_aspect=1/1", width, height, AV_PIX_FMT_YUV420P,
+           time_base.num, time_base.den, frame_rate.num, frame_rate.den);
+
+  int ret = avfilter_graph_create_filter(&src, avfilter_get_by_name("buffer"), "in", args, nullptr, graph);
+  if (ret >= 0)
+  {
+    ret = avfilter_graph_create_filter(&sink, avfilter_get_by_name("buffersink"), "out", nullptr, nullptr, graph);
+  }
+  if (ret < 0)
+  {
+    avfilter_graph_free(&graph);
+    throw stage_error(pipeline_stage::encoder, "Could not create filter graph endpoints!");
+  }
+
+  AVFilterInOut *outputs = avfilter_inout_alloc();
+  outputs->name = av_strdup("in");
+  outputs->filter_ctx = src;
+  outputs->pad_idx = 0;
+  outputs->next = nullptr;
+
+  AVFilterInOut *inputs = avfilter_inout_alloc();
+  inputs->name = av_strdup("out");
+  inputs->filter_ctx = sink;
+  inputs->pad_idx = 0;
+  inputs->next = nullptr;
+
+  // whatever the user asks for, the encoder takes yuv420p
+  std::string full = description + ",format=yuv420p";
+  ret = avfilter_graph_parse_ptr(graph, full.c_str(), &inputs, &outputs, nullptr);
+  avfilter_inout_free(&inputs);
+  avfilter_inout_free(&outputs);
+  if (ret < 0)
+  {
+    avfilter_graph_free(&graph);
+    throw stage_error(pipeline_stage::encoder, "Could not parse filter graph " + description + "!");
+  }
+
+  if (avfilter_graph_config(graph, nullptr) < 0)
+  {
+    avfilter_graph_free(&graph);
+    throw stage_error(pipeline_stage::encoder, "Could not configure filter graph " + description + "!");
+  }
+}
+
+filter_graph::~filter_graph()
+{
+  avfilter_graph_free(&graph);
+}
+
+void filter_graph::push(AVFrame *frame)
+{
+  if (av_buffersrc_add_frame_flags(src, frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0)
+  {
+    throw stage_error(pipeline_stage::encoder, "Error feeding the filter graph!");
+  }
+}
+
+bool filter_graph::pull(AVFrame *frame)
+{
+  int ret = av_buffersink_get_frame(sink, frame);
+  if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+  {
+    return false;
+  }
+  if (ret < 0)
+  {
+    throw stage_error(pipeline_stage::encoder, "Error reading from the filter graph!");
+  }
+  return true;
+}
+
+int filter_graph::width() const
+{
+  return av_buffersink_get_w(sink);
+}
+
+int filter_graph::height() const
+{
+  return av_buffersink_get_h(sink);
+}
+
+AVRational filter_graph::time_base() const
+{
+  return av_buffersink_get_time_base(sink);
+}
+
+bool filter_graph::changes_geometry() const
+{
+  if (width() != in_width || height() != in_height)
+  {
+    return true;
+  }
+
+  // a scale back to the same size may still crop or flip on the way
+  static const char *moving[] = {"crop", "scale", "pad", "rotate", "transpose", "hflip", "vflip", "zoompan", "perspective", "lenscorrection", "deshake"};
+  for (unsigned i = 0; i < graph->nb_filters; i++)
+  {
+    // scalers libavfilter inserts on its own only convert pixel formats
+    if (graph->filters[i]->name && strncmp(graph->filters[i]->name, "auto_", 5) == 0)
+    {
+      continue;
+    }
+    for (const char *name : moving)
+    {
+      if (strcmp(graph->filters[i]->filter->name, name) == 0)
+      {
+        return true;
+      }
+    }
+  }
+  return false;
+}
@@ -0,0 +1,44 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <string>
+
+extern "C"
+{
+#include <libavfilter/avfilter.h>
+#include <libavutil/frame.h>
+}
+
+// a libavfilter graph between conversion and the encoder, fed yuv420p frames and always handing yuv420p
+// frames back. output frames reference the graph's buffers and go to the encoder without a copy.
+// the graph is rebuilt mid-stream, so failures throw a stage_error for the encoder stage
+class filter_graph
+{
+public:
+  filter_graph(const std::string &description, int width, int height, AVRational time_base, AVRational frame_rate, int threads);
+  ~filter_graph();
+
+  // the graph takes a reference, the caller has to make the frame writable before reusing it.
+  // nullptr ends the stream, pull then hands out whatever the filters still hold
+  void push(AVFrame *frame);
+
+  // returns false once the graph needs more input
+  bool pull(AVFrame *frame);
+
+  int width() const;
+  int height() const;
+  AVRational time_base() const;
+
+  // the graph scales, crops, pads or otherwise moves the picture around, so coordinates on the frames
+  // going in do not hold for the frames coming out
+  bool changes_geometry() const;
+
+private:
+  int in_width;
+  int in_height;
+  AVFilterGraph *graph;
+  AVFilterContext *src;
+  AVFilterContext *sink;
+};
+
+#endif
@@ -0,0 +1,126 @@
+#include "frame-clock.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+extern "C"
+{
+#include <libavutil/mathematics.h>
+}
+
+// device clocks are pulled towards the monotonic clock by at most this much per frame
+static const int64_t max_clock_slew_us = 500;
+// anything bigger is a device clock reset rather than drift
+static const int64_t max_clock_jump_us = 500000;
+
+int64_t monotonic_time_us()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+frame_clock::frame_clock(AVRational time_base, int fps, bool cfr, bool device_clock)
+    : time_base(time_base), fps(fps), cfr(cfr), device_clock(device_clock), started(false), has_origin(false), has_offset(false), origin_us(0),
+      clock_offset_us(0), scheduled_pts(0), last_pts(-1), last_slot(-1), slot_base_pts(0), drops(0), dups(0)
+{
+}
+
+void frame_clock::set_origin(int64_t origin_us)
+{
+  this->origin_us = origin_us;
+  has_origin = true;
+}
+
+int frame_clock::schedule(int64_t timestamp_us)
+{
+  if (device_clock)
+  {
+    // map the camera clock onto the monotonic clock, slewing slowly so that jitter in when we
+    // read the frame does not leak into the timestamps while long term drift is still corrected
+    int64_t offset = monotonic_time_us() - timestamp_us;
+    if (!has_offset || std::abs(offset - clock_offset_us) > max_clock_jump_us)
+    {
+      // re-anchoring puts the frame back onto the monotonic timeline, so the pts carry on smoothly
+      clock_offset_us = offset;
+      has_offset = true;
+    }
+    else
+    {
+      clock_offset_us += std::max(-max_clock_slew_us, std::min(max_clock_slew_us, offset - clock_offset_us));
+    }
+
+    timestamp_us += clock_offset_us;
+  }
+
+  return schedule_monotonic(timestamp_us);
+}
+
+int frame_clock::schedule_monotonic(int64_t timestamp_us)
+{
+  if (!started)
+  {
+    if (!has_origin)
+    {
+      origin_us = timestamp_us;
+    }
+    started = true;
+  }
+
+  int64_t elapsed_us = timestamp_us - origin_us;
+
+  if (!cfr)
+  {
+    scheduled_pts = std::max(av_rescale_q(elapsed_us, av_make_q(1, 1000000), time_base), last_pts + 1);
+    return 1;
+  }
+
+  int64_t slot = av_rescale_q_rnd(elapsed_us, av_make_q(1, 1000000), av_make_q(1, fps), AV_ROUND_NEAR_INF);
+  if (slot <= last_slot)
+  {
+    drops++;
+    return 0;
+  }
+
+  int64_t copies = slot - last_slot;
+  if (copies > fps)
+  {
+    // after a long stall jump ahead rather than replaying a second worth of the same frame
+    last_slot = slot - 1;
+    copies = 1;
+  }
+
+  dups += copies - 1;
+  return static_cast<int>(copies);
+}
+
+int64_t frame_clock::next_pts()
+{
+  if (cfr)
+  {
+    last_slot++;
+    scheduled_pts = slot_base_pts + av_rescale_q(last_slot, av_make_q(1, fps), time_base);
+  }
+
+  last_pts = scheduled_pts;
+  return last_pts;
+}
+
+void frame_clock::skip(int copies)
+{
+  if (cfr)
+  {
+    last_slot += copies;
+  }
+}
+
+void frame_clock::set_fps(int fps)
+{
+  if (cfr && last_slot >= 0)
+  {
+    // the new grid starts where the old one ends, slot 0 being the next one
+    origin_us += av_rescale(last_slot + 1, 1000000, this->fps);
+    slot_base_pts += av_rescale_q(last_slot + 1, av_make_q(1, this->fps), time_base);
+    last_slot = -1;
+  }
+  this->fps = fps;
+}
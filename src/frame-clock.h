@@ -0,0 +1,61 @@
+#ifndef FRAME_CLOCK_H
+#define FRAME_CLOCK_H
+
+#include <cstdint>
+
+extern "C"
+{
+#include <libavutil/rational.h>
+}
+
+int64_t monotonic_time_us();
+
+// turns capture timestamps into encoder pts, either passing the real frame spacing through (vfr)
+// or snapping frames onto a constant rate grid by dropping and duplicating them (cfr)
+class frame_clock
+{
+public:
+  frame_clock(AVRational time_base, int fps, bool cfr, bool device_clock);
+
+  // anchors pts 0 at origin_us instead of at the first frame, so other streams can share the timeline
+  void set_origin(int64_t origin_us);
+
+  // returns how many times the frame captured at timestamp_us has to be encoded, 0 drops it
+  int schedule(int64_t timestamp_us);
+
+  // the same for a frame the pipeline makes up itself, timed on the monotonic clock. the mapping of
+  // the camera clock is left alone
+  int schedule_monotonic(int64_t now_us);
+
+  // pts for the next copy of the scheduled frame
+  int64_t next_pts();
+
+  // gives up the slots of a scheduled frame that is not going to be encoded, so they are not filled later
+  void skip(int copies);
+
+  // continues the constant rate grid at another rate from the next slot on
+  void set_fps(int fps);
+
+  uint64_t dropped() const { return drops; }
+  uint64_t duplicated() const { return dups; }
+
+private:
+  AVRational time_base;
+  int fps;
+  bool cfr;
+  bool device_clock;
+  bool started;
+  bool has_origin;
+  // frames made up before the first camera frame must not count as a device clock reset
+  bool has_offset;
+  int64_t origin_us;
+  int64_t clock_offset_us;
+  int64_t scheduled_pts;
+  int64_t last_pts;
+  int64_t last_slot;
+  int64_t slot_base_pts;
+  uint64_t drops;
+  uint64_t dups;
+};
+
+#endif
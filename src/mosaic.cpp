@@ -0,0 +1,186 @@
+#include "mosaic.h"
+#include "frame-clock.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <utility>
+
+#include <opencv2/imgproc.hpp>
+
+// how long teardown waits for the readers to let go of their cameras
+static const int64_t max_release_wait_us = 1000000;
+
+// largest even size with the aspect of src that fits into area
+static cv::Size fit_size(const cv::Size &src, const cv::Size &area)
+{
+  double scale = std::min(static_cast<double>(area.width) / src.width, static_cast<double>(area.height) / src.height);
+  return cv::Size(std::max(2, static_cast<int>(src.width * scale) & ~1), std::max(2, static_cast<int>(src.height * scale) & ~1));
+}
+
+mosaic_source::mosaic_source(std::vector<cv::VideoCapture> cams, double width, double height, int fps)
+    : interval_us(1000000 / std::max(1, fps)), next_due_us(0)
+{
+  for (cv::VideoCapture &cam : cams)
+  {
+    tiles.push_back(std::make_shared<tile>());
+    tiles.back()->cam = cam;
+    tiles.back()->abandoned = false;
+  }
+  layout(width, height);
+
+  // detached, a reader stuck in cam.read() must not hold up teardown or a reopen of the mosaic
+  for (auto &t : tiles)
+  {
+    std::thread(&mosaic_source::read_loop, t).detach();
+  }
+}
+
+mosaic_source::~mosaic_source()
+{
+  for (auto &t : tiles)
+  {
+    t->abandoned = true;
+  }
+
+  // the cameras are opened again right after a reopen, give the readers a moment to close them
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(max_release_wait_us);
+  for (auto &t : tiles)
+  {
+    std::unique_lock<std::mutex> l(t->lock);
+    if (!t->released.wait_until(l, deadline, [&t] { return t->closed; }))
+    {
+      std::cout << "A mosaic camera is stuck in the driver, leaving it behind" << std::endl;
+    }
+  }
+}
+
+void mosaic_source::layout(int width, int height)
+{
+  // as square a grid as the number of cameras allows, filled row by row
+  int count = static_cast<int>(tiles.size());
+  int columns = static_cast<int>(std::ceil(std::sqrt(count)));
+  int rows = (count + columns - 1) / columns;
+
+  canvas.create(height, width, CV_8UC3);
+  canvas.setTo(cv::Scalar::all(0));
+
+  for (int i = 0; i < count; i++)
+  {
+    int x = width * (i % columns) / columns & ~1;
+    int y = height * (i / columns) / rows & ~1;
+    int right = width * (i % columns + 1) / columns & ~1;
+    int bottom = height * (i / columns + 1) / rows & ~1;
+
+    std::lock_guard<std::mutex> l(tiles[i]->lock);
+    tiles[i]->area = cv::Rect(x, y, right - x, bottom - y);
+    tiles[i]->content = cv::Rect();
+    tiles[i]->dirty = !tiles[i]->scaled.empty();
+  }
+}
+
+void mosaic_source::read_loop(std::shared_ptr<tile> t)
+{
+  cv::Mat captured, scaled;
+  while (!t->abandoned)
+  {
+    if (!t->cam.read(captured) || captured.empty())
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      continue;
+    }
+
+    cv::Size area;
+    {
+      std::lock_guard<std::mutex> l(t->lock);
+      area = t->area.size();
+    }
+
+    // scaled here so the cameras scale in parallel and the mosaic only copies
+    cv::Size size = fit_size(captured.size(), area);
+    cv::resize(captured, scaled, size, 0, 0, size.area() < captured.size().area() ? cv::INTER_AREA : cv::INTER_LINEAR);
+
+    std::lock_guard<std::mutex> l(t->lock);
+    std::swap(t->scaled, scaled);
+    t->dirty = true;
+    t->delivered++;
+  }
+
+  t->cam.release();
+  std::lock_guard<std::mutex> l(t->lock);
+  t->closed = true;
+  t->released.notify_all();
+}
+
+bool mosaic_source::read(cv::Mat &image, int64_t &timestamp_us)
+{
+  // the mosaic runs at the output rate no matter how fast the cameras are
+  int64_t now = monotonic_time_us();
+  if (next_due_us > now)
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(next_due_us - now));
+  }
+  else if (now - next_due_us > interval_us)
+  {
+    next_due_us = now;
+  }
+  next_due_us += interval_us;
+
+  for (auto &t : tiles)
+  {
+    std::lock_guard<std::mutex> l(t->lock);
+    if (!t->dirty)
+    {
+      continue;
+    }
+
+    cv::Size size = fit_size(t->scaled.size(), t->area.size());
+    cv::Rect content(t->area.x + ((t->area.width - size.width) / 2 & ~1), t->area.y + ((t->area.height - size.height) / 2 & ~1), size.width, size.height);
+    if (content != t->content)
+    {
+      // new letterbox, clear the bars
+      canvas(t->area).setTo(cv::Scalar::all(0));
+      t->content = content;
+    }
+
+    // frames scaled for an older layout are rescaled on the way in
+    cv::Mat target = canvas(content);
+    if (size == t->scaled.size())
+    {
+      t->scaled.copyTo(target);
+    }
+    else
+    {
+      cv::resize(t->scaled, target, size, 0, 0, cv::INTER_AREA);
+    }
+    t->dirty = false;
+    t->shown++;
+  }
+
+  image = canvas;
+  timestamp_us = monotonic_time_us();
+  return true;
+}
+
+void mosaic_source::set_size(double width, double height)
+{
+  layout(width, height);
+}
+
+void mosaic_source::set_fps(double fps)
+{
+  // the cameras keep their own rates, only the mosaic follows
+  interval_us = static_cast<int64_t>(1000000 / std::max(1.0, fps));
+}
+
+uint64_t mosaic_source::skipped() const
+{
+  uint64_t count = 0;
+  for (auto &t : tiles)
+  {
+    std::lock_guard<std::mutex> l(t->lock);
+    count += t->delivered - t->shown;
+  }
+  return count;
+}
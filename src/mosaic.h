@@ -0,0 +1,60 @@
+#ifndef MOSAIC_H
+#define MOSAIC_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "capture.h"
+
+// tiles several cameras into one grid. every camera is read and scaled into its tile on its own
+// thread at whatever rate it delivers, the mosaic goes out at a fixed rate and a camera that stalls
+// is held at its last frame
+class mosaic_source : public frame_source
+{
+public:
+  mosaic_source(std::vector<cv::VideoCapture> cams, double width, double height, int fps);
+  // waits a moment for the readers to close their cameras, one stuck in the driver is left behind
+  ~mosaic_source();
+
+  bool read(cv::Mat &image, int64_t &timestamp_us) override;
+  void set_size(double width, double height) override;
+  void set_fps(double fps) override;
+  uint64_t skipped() const override;
+
+private:
+  // shared with a reader thread that may outlive the mosaic while it hangs in the driver
+  struct tile
+  {
+    cv::VideoCapture cam;
+    std::atomic<bool> abandoned;
+    std::mutex lock;
+    // the reader has closed the camera
+    std::condition_variable released;
+    // place in the grid, the scaled frame is letterboxed into it
+    cv::Rect area;
+    cv::Rect content;
+    cv::Mat scaled;
+    bool dirty = false;
+    bool closed = false;
+    uint64_t delivered = 0;
+    uint64_t shown = 0;
+  };
+
+  static void read_loop(std::shared_ptr<tile> t);
+  void layout(int width, int height);
+
+  std::vector<std::shared_ptr<tile>> tiles;
+  cv::Mat canvas;
+  int64_t interval_us;
+  int64_t next_due_us;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#include "motion.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const int block_size = 16;
+static const int row_step = 4;
+static const int samples_per_block = block_size * block_size / row_step;
+
+static int block_sad(const uint8_t *a, const uint8_t *b)
+{
+#ifdef __SSE2__
+  __m128i sad = _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(b)));
+  return _mm_cvtsi128_si32(sad) + _mm_cvtsi128_si32(_mm_srli_si128(sad, 8));
+#else
+  int sad = 0;
+  for (int i = 0; i < block_size; i++)
+  {
+    sad += std::abs(a[i] - b[i]);
+  }
+  return sad;
+#endif
+}
+
+motion_detector::motion_detector(int fps, int idle_fps, int threshold)
+    : idle_interval_us(idle_fps > 0 ? 1000000 / idle_fps : 0), threshold(threshold), idle_after(std::max(1, fps)), width(0), height(0), columns(0),
+      rows(0), static_frames(0), last_encoded_us(0), skips(0)
+{
+}
+
+void motion_detector::reset(const AVFrame *frame)
+{
+  width = frame->width;
+  height = frame->height;
+  columns = width / block_size;
+  rows = height / block_size;
+  reference.assign(columns * block_size * rows * (block_size / row_step), 0);
+  moving.assign(columns * rows, 1);
+  static_frames = 0;
+}
+
+void motion_detector::update_reference(const AVFrame *frame)
+{
+  size_t line = columns * block_size;
+  for (int y = 0, i = 0; y < rows * block_size; y += row_step, i++)
+  {
+    memcpy(&reference[i * line], frame->data[0] + y * frame->linesize[0], line);
+  }
+}
+
+bool motion_detector::should_encode(const AVFrame *frame, int64_t timestamp_us)
+{
+  if (frame->width != width || frame->height != height)
+  {
+    reset(frame);
+    update_reference(frame);
+    last_encoded_us = timestamp_us;
+    return true;
+  }
+
+  size_t line = columns * block_size;
+  int limit = threshold * samples_per_block;
+  bool motion = false;
+  for (int by = 0; by < rows; by++)
+  {
+    for (int bx = 0; bx < columns; bx++)
+    {
+      int sad = 0;
+      for (int r = 0; r < block_size / row_step; r++)
+      {
+        int y = by * block_size + r * row_step;
+        sad += block_sad(frame->data[0] + y * frame->linesize[0] + bx * block_size, &reference[(y / row_step) * line + bx * block_size]);
+      }
+
+      moving[by * columns + bx] = sad > limit;
+      motion |= sad > limit;
+    }
+  }
+
+  if (motion)
+  {
+    static_frames = 0;
+  }
+  else if (static_frames < idle_after)
+  {
+    static_frames++;
+  }
+
+  // a static scene still gets a frame every idle interval so slow changes like lighting show up.
+  // without an idle rate nothing is skipped
+  if (!idle_interval_us || !idle() || timestamp_us - last_encoded_us >= idle_interval_us)
+  {
+    update_reference(frame);
+    last_encoded_us = timestamp_us;
+    return true;
+  }
+
+  skips++;
+  return false;
+}
@@ -0,0 +1,49 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <cstdint>
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+// compares every 4th luma row of 16x16 blocks against the last encoded frame. while nothing moves
+// the frame rate drops to idle_fps, the first frame with motion is encoded straight away. an idle_fps
+// of 0 keeps every frame and only tracks the moving blocks
+class motion_detector
+{
+public:
+  motion_detector(int fps, int idle_fps, int threshold);
+
+  // decides on the converted frame, before any overlay is burnt in
+  bool should_encode(const AVFrame *frame, int64_t timestamp_us);
+
+  bool idle() const { return static_frames >= idle_after; }
+  uint64_t skipped() const { return skips; }
+
+  // blocks that differed from the reference in the last call, row major, blocks_x() per row
+  const std::vector<uint8_t> &moving_blocks() const { return moving; }
+  int blocks_x() const { return columns; }
+  int blocks_y() const { return rows; }
+
+private:
+  void reset(const AVFrame *frame);
+  void update_reference(const AVFrame *frame);
+
+  int64_t idle_interval_us;
+  int threshold;
+  int idle_after;
+  int width;
+  int height;
+  int columns;
+  int rows;
+  std::vector<uint8_t> reference;
+  std::vector<uint8_t> moving;
+  int static_frames;
+  int64_t last_encoded_us;
+  uint64_t skips;
+};
+
+#endif
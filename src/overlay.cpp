@@ -0,0 +1,339 @@
+#include "overlay.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const int margin = 16;
+static const char clock_format[] = "%Y-%m-%d %H:%M:%S";
+static const char clock_glyphs[] = "0123456789-: ";
+
+static uint8_t premultiply(int value, int alpha)
+{
+  return static_cast<uint8_t>((value * alpha + 127) / 255);
+}
+
+yuva_tile make_tile(const cv::Mat &bgra)
+{
+  yuva_tile tile;
+  tile.width = (bgra.cols + 1) & ~1;
+  tile.height = (bgra.rows + 1) & ~1;
+  tile.y.assign(tile.width * tile.height, 0);
+  tile.a.assign(tile.width * tile.height, 0);
+  tile.u.assign(tile.width * tile.height / 4, 0);
+  tile.v.assign(tile.width * tile.height / 4, 0);
+  tile.ca.assign(tile.width * tile.height / 4, 0);
+
+  int min_x = tile.width, min_y = tile.height, max_x = -1, max_y = -1;
+  std::vector<int> u_sum(tile.width * tile.height / 4, 0), v_sum(u_sum.size(), 0), a_sum(u_sum.size(), 0);
+  for (int row = 0; row < bgra.rows; row++)
+  {
+    const uint8_t *px = bgra.ptr<uint8_t>(row);
+    for (int col = 0; col < bgra.cols; col++, px += 4)
+    {
+      int b = px[0], g = px[1], r = px[2], alpha = px[3];
+      if (!alpha)
+      {
+        continue;
+      }
+
+      // bt.601 limited range, the same matrix swscale uses for the camera frames
+      int y = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+      int u = 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+      int v = 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+
+      int i = row * tile.width + col;
+      tile.y[i] = premultiply(y, alpha);
+      tile.a[i] = static_cast<uint8_t>(alpha);
+
+      int c = (row / 2) * (tile.width / 2) + col / 2;
+      u_sum[c] += u * alpha;
+      v_sum[c] += v * alpha;
+      a_sum[c] += alpha;
+
+      min_x = std::min(min_x, col);
+      min_y = std::min(min_y, row);
+      max_x = std::max(max_x, col);
+      max_y = std::max(max_y, row);
+    }
+  }
+
+  for (size_t c = 0; c < a_sum.size(); c++)
+  {
+    tile.u[c] = static_cast<uint8_t>((u_sum[c] / 4 + 127) / 255);
+    tile.v[c] = static_cast<uint8_t>((v_sum[c] / 4 + 127) / 255);
+    tile.ca[c] = static_cast<uint8_t>(a_sum[c] / 4);
+  }
+
+  if (max_x >= 0)
+  {
+    // keep the box on even coordinates so it maps exactly onto the chroma planes
+    min_x &= ~1;
+    min_y &= ~1;
+    tile.visible = cv::Rect(min_x, min_y, ((max_x + 2) & ~1) - min_x, ((max_y + 2) & ~1) - min_y);
+  }
+
+  return tile;
+}
+
+static void copy_plane(std::vector<uint8_t> &dst, int dst_width, const std::vector<uint8_t> &src, int src_width, int src_height, int x, int y)
+{
+  for (int row = 0; row < src_height; row++)
+  {
+    std::copy(src.begin() + row * src_width, src.begin() + (row + 1) * src_width, dst.begin() + (y + row) * dst_width + x);
+  }
+}
+
+void copy_tile(yuva_tile &dst, const yuva_tile &src, int x, int y)
+{
+  copy_plane(dst.y, dst.width, src.y, src.width, src.height, x, y);
+  copy_plane(dst.a, dst.width, src.a, src.width, src.height, x, y);
+  copy_plane(dst.u, dst.width / 2, src.u, src.width / 2, src.height / 2, x / 2, y / 2);
+  copy_plane(dst.v, dst.width / 2, src.v, src.width / 2, src.height / 2, x / 2, y / 2);
+  copy_plane(dst.ca, dst.width / 2, src.ca, src.width / 2, src.height / 2, x / 2, y / 2);
+}
+
+// dst = src + dst * (255 - alpha) / 255, with src already premultiplied
+static void blend_row(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int n)
+{
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i opaque = _mm_set1_epi16(255);
+  const __m128i round = _mm_set1_epi16(128);
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(alpha + i));
+
+    __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(opaque, _mm_unpacklo_epi8(a, zero)));
+    __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(opaque, _mm_unpackhi_epi8(a, zero)));
+    lo = _mm_add_epi16(lo, round);
+    hi = _mm_add_epi16(hi, round);
+    // exact division by 255: (t + (t >> 8)) >> 8
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_adds_epu8(_mm_packus_epi16(lo, hi), s));
+  }
+#endif
+  for (; i < n; i++)
+  {
+    int t = dst[i] * (255 - alpha[i]) + 128;
+    dst[i] = static_cast<uint8_t>(std::min(255, src[i] + ((t + (t >> 8)) >> 8)));
+  }
+}
+
+static void blend_plane(uint8_t *dst, int linesize, const uint8_t *src, const uint8_t *alpha, int tile_width, const cv::Rect &rect, int x, int y)
+{
+  for (int row = rect.y; row < rect.y + rect.height; row++)
+  {
+    int offset = row * tile_width + rect.x;
+    blend_row(dst + (y + row) * linesize + x + rect.x, src + offset, alpha + offset, rect.width);
+  }
+}
+
+void blend_tile(AVFrame *frame, const yuva_tile &tile, int x, int y)
+{
+  x &= ~1;
+  y &= ~1;
+
+  // clip the visible part of the tile against the frame, in tile coordinates
+  cv::Rect rect = tile.visible & cv::Rect(-x, -y, frame->width & ~1, frame->height & ~1);
+  rect.width &= ~1;
+  rect.height &= ~1;
+  if (rect.empty())
+  {
+    return;
+  }
+
+  blend_plane(frame->data[0], frame->linesize[0], tile.y.data(), tile.a.data(), tile.width, rect, x, y);
+
+  cv::Rect chroma(rect.x / 2, rect.y / 2, rect.width / 2, rect.height / 2);
+  blend_plane(frame->data[1], frame->linesize[1], tile.u.data(), tile.ca.data(), tile.width / 2, chroma, x / 2, y / 2);
+  blend_plane(frame->data[2], frame->linesize[2], tile.v.data(), tile.ca.data(), tile.width / 2, chroma, x / 2, y / 2);
+}
+
+static cv::Mat render_text(const std::string &text, double scale, int width, int height)
+{
+  int baseline = 0;
+  int thickness = std::max(1, static_cast<int>(scale * 2));
+  cv::Size size = cv::getTextSize(text, cv::FONT_HERSHEY_SIMPLEX, scale, thickness, &baseline);
+  if (width <= 0)
+  {
+    width = size.width + 2 * thickness;
+    height = size.height + baseline + 2 * thickness;
+  }
+
+  // white on a dark outline so it reads on any background
+  cv::Mat bgra(height, width, CV_8UC4, cv::Scalar::all(0));
+  cv::Point origin((width - size.width) / 2, height - baseline - thickness);
+  cv::putText(bgra, text, origin, cv::FONT_HERSHEY_SIMPLEX, scale, cv::Scalar(0, 0, 0, 160), thickness + 2, cv::LINE_AA);
+  cv::putText(bgra, text, origin, cv::FONT_HERSHEY_SIMPLEX, scale, cv::Scalar(255, 255, 255, 255), thickness, cv::LINE_AA);
+  return bgra;
+}
+
+overlay::overlay()
+    : timestamp(false), rendered_height(0), font_scale(1), cell_width(0), cell_height(0), clock_second(0)
+{
+}
+
+void overlay::set_timestamp(bool enabled)
+{
+  timestamp = enabled;
+  rendered_height = 0;
+}
+
+void overlay::set_text(const std::string &text)
+{
+  this->text = text;
+  rendered_height = 0;
+}
+
+bool overlay::set_logo(const std::string &path)
+{
+  cv::Mat image = cv::imread(path, cv::IMREAD_UNCHANGED);
+  if (image.empty())
+  {
+    std::cout << "Could not read logo " << path << "!" << std::endl;
+    return false;
+  }
+
+  if (image.channels() == 4)
+  {
+    logo = image;
+  }
+  else
+  {
+    cv::cvtColor(image, logo, image.channels() == 1 ? cv::COLOR_GRAY2BGRA : cv::COLOR_BGR2BGRA);
+  }
+  rendered_height = 0;
+  return true;
+}
+
+bool overlay::empty() const
+{
+  return !timestamp && text.empty() && logo.empty();
+}
+
+void overlay::render(int frame_height)
+{
+  // sized relative to the output so the overlay keeps its look across resolution changes
+  rendered_height = frame_height;
+  font_scale = std::max(0.4, frame_height / 720.0);
+
+  glyphs.clear();
+  if (timestamp)
+  {
+    cell_width = 0;
+    cell_height = 0;
+    for (const char *c = clock_glyphs; *c; c++)
+    {
+      cv::Mat glyph = render_text(std::string(1, *c), font_scale, 0, 0);
+      cell_width = std::max(cell_width, glyph.cols);
+      cell_height = std::max(cell_height, glyph.rows);
+    }
+    cell_width = (cell_width + 1) & ~1;
+    cell_height = (cell_height + 1) & ~1;
+
+    // every glyph on the same even sized cell, so a changed digit is a plain tile copy
+    for (const char *c = clock_glyphs; *c; c++)
+    {
+      glyphs[*c] = make_tile(render_text(std::string(1, *c), font_scale, cell_width, cell_height));
+    }
+
+    clock_text.clear();
+    clock_second = 0;
+  }
+
+  text_tile = text.empty() ? yuva_tile() : make_tile(render_text(text, font_scale, 0, 0));
+
+  if (!logo.empty())
+  {
+    cv::Mat scaled = logo;
+    int max_height = frame_height / 6;
+    if (logo.rows > max_height)
+    {
+      cv::resize(logo, scaled, cv::Size(logo.cols * max_height / logo.rows, max_height), 0, 0, cv::INTER_AREA);
+    }
+    logo_tile = make_tile(scaled);
+  }
+}
+
+void overlay::update_clock()
+{
+  time_t now = time(nullptr);
+  if (now == clock_second)
+  {
+    return;
+  }
+  clock_second = now;
+
+  char buf[64];
+  struct tm local;
+  localtime_r(&now, &local);
+  strftime(buf, sizeof(buf), clock_format, &local);
+  std::string next(buf);
+
+  if (next.size() != clock_text.size())
+  {
+    clock_tile = yuva_tile();
+    clock_tile.width = cell_width * static_cast<int>(next.size());
+    clock_tile.height = cell_height;
+    clock_tile.y.assign(clock_tile.width * clock_tile.height, 0);
+    clock_tile.a.assign(clock_tile.y.size(), 0);
+    clock_tile.u.assign(clock_tile.y.size() / 4, 0);
+    clock_tile.v.assign(clock_tile.y.size() / 4, 0);
+    clock_tile.ca.assign(clock_tile.y.size() / 4, 0);
+    clock_tile.visible = cv::Rect(0, 0, clock_tile.width, clock_tile.height);
+    clock_text.assign(next.size(), '\0');
+  }
+
+  // only the cells whose character changed are touched, usually just the last digit or two
+  for (size_t i = 0; i < next.size(); i++)
+  {
+    if (next[i] != clock_text[i])
+    {
+      auto glyph = glyphs.find(next[i]);
+      if (glyph != glyphs.end())
+      {
+        copy_tile(clock_tile, glyph->second, static_cast<int>(i) * cell_width, 0);
+      }
+    }
+  }
+  clock_text = next;
+}
+
+void overlay::apply(AVFrame *frame)
+{
+  if (empty())
+  {
+    return;
+  }
+
+  if (rendered_height != frame->height)
+  {
+    render(frame->height);
+  }
+
+  if (timestamp)
+  {
+    update_clock();
+    blend_tile(frame, clock_tile, margin, frame->height - clock_tile.height - margin);
+  }
+  if (!text_tile.y.empty())
+  {
+    blend_tile(frame, text_tile, margin, margin);
+  }
+  if (!logo_tile.y.empty())
+  {
+    blend_tile(frame, logo_tile, frame->width - logo_tile.width - margin, margin);
+  }
+}
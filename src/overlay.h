@@ -0,0 +1,66 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+// a pre-rendered yuv420p image with premultiplied colour planes and alpha at luma and chroma size
+struct yuva_tile
+{
+  int width = 0;
+  int height = 0;
+  std::vector<uint8_t> y, a;
+  std::vector<uint8_t> u, v, ca;
+  // bounding box of the pixels that are not fully transparent, nothing outside it is blended
+  cv::Rect visible;
+};
+
+yuva_tile make_tile(const cv::Mat &bgra);
+void copy_tile(yuva_tile &dst, const yuva_tile &src, int x, int y);
+void blend_tile(AVFrame *frame, const yuva_tile &tile, int x, int y);
+
+// burns a clock, a text line and a logo into yuv420p frames after colour conversion. everything is
+// rendered once into tiles, per frame only the tile rectangles are alpha blended
+class overlay
+{
+public:
+  overlay();
+
+  void set_timestamp(bool enabled);
+  void set_text(const std::string &text);
+  bool set_logo(const std::string &path);
+  bool empty() const;
+
+  void apply(AVFrame *frame);
+
+private:
+  void render(int frame_height);
+  void update_clock();
+
+  bool timestamp;
+  std::string text;
+  cv::Mat logo;
+
+  int rendered_height;
+  double font_scale;
+  int cell_width;
+  int cell_height;
+  std::map<char, yuva_tile> glyphs;
+  yuva_tile clock_tile;
+  yuva_tile text_tile;
+  yuva_tile logo_tile;
+  std::string clock_text;
+  time_t clock_second;
+};
+
+#endif
@@ -0,0 +1,208 @@
+#include "processing.h"
+
+#include <dlfcn.h>
+#include <iostream>
+
+#include <opencv2/imgproc.hpp>
+
+class blur_processor : public frame_processor
+{
+public:
+  void process(const cv::Mat &input, cv::Mat &output) override
+  {
+    cv::GaussianBlur(input, output, cv::Size(9, 9), 0);
+  }
+};
+
+class gray_processor : public frame_processor
+{
+public:
+  void process(const cv::Mat &input, cv::Mat &output) override
+  {
+    cv::cvtColor(input, gray, cv::COLOR_BGR2GRAY);
+    cv::cvtColor(gray, output, cv::COLOR_GRAY2BGR);
+  }
+
+private:
+  cv::Mat gray;
+};
+
+class edges_processor : public frame_processor
+{
+public:
+  void process(const cv::Mat &input, cv::Mat &output) override
+  {
+    cv::cvtColor(input, gray, cv::COLOR_BGR2GRAY);
+    cv::Canny(gray, edges, 50, 150);
+    cv::cvtColor(edges, output, cv::COLOR_GRAY2BGR);
+  }
+
+private:
+  cv::Mat gray;
+  cv::Mat edges;
+};
+
+frame_processor *create_frame_processor(const std::string &spec)
+{
+  if (spec == "blur")
+  {
+    return new blur_processor();
+  }
+  if (spec == "gray")
+  {
+    return new gray_processor();
+  }
+  if (spec == "edges")
+  {
+    return new edges_processor();
+  }
+
+  size_t colon = spec.find(':');
+  std::string path = spec.substr(0, colon);
+  std::string args = colon == std::string::npos ? "" : spec.substr(colon + 1);
+
+  // the library stays loaded for the life of the process, processors may be created from it at any time
+  void *library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!library)
+  {
+    std::cout << "Could not load frame processor " << path << ": " << dlerror() << std::endl;
+    exit(1);
+  }
+
+  auto create = reinterpret_cast<create_frame_processor_fn>(dlsym(library, FRAME_PROCESSOR_ENTRY));
+  if (!create)
+  {
+    std::cout << "Frame processor " << path << " does not export " << FRAME_PROCESSOR_ENTRY << "!" << std::endl;
+    exit(1);
+  }
+
+  frame_processor *processor = create(args.c_str());
+  if (!processor)
+  {
+    std::cout << "Frame processor " << path << " failed to initialize!" << std::endl;
+    exit(1);
+  }
+  return processor;
+}
+
+processing_stage::processing_stage(const std::string &spec, int depth, int budget_ms, work_stealing_pool *pool, size_t pipeline)
+    : pool(pool), pipeline(pipeline), budget(budget_ms), depth(depth), outstanding(0), misses(0), completions(0)
+{
+  for (size_t i = 0; i < pool->size(); i++)
+  {
+    processors.emplace_back(create_frame_processor(spec));
+  }
+}
+
+processing_stage::~processing_stage()
+{
+  // late tasks still reference this stage
+  std::unique_lock<std::mutex> l(lock);
+  job_done.wait(l, [this] { return outstanding == 0; });
+}
+
+void processing_stage::work(std::shared_ptr<job> j)
+{
+  // a frame that already went out unprocessed is not worth the cpu
+  if (std::chrono::steady_clock::now() < j->deadline)
+  {
+    cv::Mat output;
+    std::vector<cv::Rect> regions;
+    try
+    {
+      processors[work_stealing_pool::current_worker()]->process(j->input, output, regions);
+    }
+    catch (const std::exception &e)
+    {
+      // a processor that throws costs this frame, not the pool worker
+      std::cout << "Frame processing failed: " << e.what() << std::endl;
+      output.release();
+    }
+
+    std::lock_guard<std::mutex> l(lock);
+    j->output = output;
+    j->regions.swap(regions);
+  }
+
+  std::lock_guard<std::mutex> l(lock);
+  j->done = true;
+  outstanding--;
+  job_done.notify_all();
+}
+
+void processing_stage::submit(const cv::Mat &image, int64_t timestamp_us)
+{
+  std::shared_ptr<job> j(new job());
+  // the capture buffer is reused for the next frame, the workers and the pass-through need their own
+  j->input = image.clone();
+  j->timestamp_us = timestamp_us;
+  j->deadline = std::chrono::steady_clock::now() + budget;
+  j->done = false;
+
+  {
+    std::lock_guard<std::mutex> l(lock);
+    in_flight.push_back(j);
+    outstanding++;
+  }
+  pool->submit(pipeline, [this, j] { work(j); });
+}
+
+bool processing_stage::next(cv::Mat &image, int64_t &timestamp_us, std::vector<cv::Rect> &regions, bool block)
+{
+  std::unique_lock<std::mutex> l(lock);
+  if (in_flight.empty())
+  {
+    return false;
+  }
+
+  std::shared_ptr<job> j = in_flight.front();
+  if (!j->done)
+  {
+    if (!block && std::chrono::steady_clock::now() < j->deadline)
+    {
+      return false;
+    }
+    job_done.wait_until(l, j->deadline, [&j] { return j->done; });
+  }
+  in_flight.pop_front();
+
+  bool usable = j->done && !j->output.empty() && j->output.type() == CV_8UC3;
+  if (usable)
+  {
+    completions++;
+    image = j->output;
+    regions.swap(j->regions);
+  }
+  else
+  {
+    misses++;
+    image = j->input;
+    regions.clear();
+  }
+  timestamp_us = j->timestamp_us;
+  return true;
+}
+
+bool processing_stage::full() const
+{
+  std::lock_guard<std::mutex> l(lock);
+  return in_flight.size() >= depth;
+}
+
+bool processing_stage::idle() const
+{
+  std::lock_guard<std::mutex> l(lock);
+  return in_flight.empty();
+}
+
+uint64_t processing_stage::missed() const
+{
+  std::lock_guard<std::mutex> l(lock);
+  return misses;
+}
+
+uint64_t processing_stage::processed() const
+{
+  std::lock_guard<std::mutex> l(lock);
+  return completions;
+}
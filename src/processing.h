@@ -0,0 +1,90 @@
+#ifndef PROCESSING_H
+#define PROCESSING_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "thread-pool.h"
+
+// a per-frame vision step that runs between capture and colour conversion. every worker thread gets
+// its own instance, so implementations do not have to be thread safe
+class frame_processor
+{
+public:
+  virtual ~frame_processor() {}
+
+  // input is read only and shared with the encoder, output has to be an 8-bit BGR image
+  virtual void process(const cv::Mat &input, cv::Mat &output) = 0;
+
+  // processors that find something worth spending bits on (faces, plates) also report it, in input
+  // image coordinates, and the encoder favours those regions
+  virtual void process(const cv::Mat &input, cv::Mat &output, std::vector<cv::Rect> &regions)
+  {
+    process(input, output);
+  }
+};
+
+// plugins are shared libraries exporting this symbol
+extern "C" typedef frame_processor *(*create_frame_processor_fn)(const char *args);
+#define FRAME_PROCESSOR_ENTRY "create_frame_processor"
+
+// builtin (blur | gray | edges) or <path.so>[:args]
+frame_processor *create_frame_processor(const std::string &spec);
+
+// runs processors on the shared pool with several frames in flight and hands frames back in capture
+// order. a frame whose processing misses its deadline goes out unprocessed, the live stream never
+// waits longer than the budget
+class processing_stage
+{
+public:
+  // depth is the number of frames in flight, every pool worker gets its own processor instance
+  processing_stage(const std::string &spec, int depth, int budget_ms, work_stealing_pool *pool, size_t pipeline);
+  ~processing_stage();
+
+  void submit(const cv::Mat &image, int64_t timestamp_us);
+
+  // returns the oldest frame once it is processed or past its deadline. without block it returns
+  // false instead of waiting
+  bool next(cv::Mat &image, int64_t &timestamp_us, std::vector<cv::Rect> &regions, bool block);
+
+  bool full() const;
+  bool idle() const;
+  uint64_t missed() const;
+  uint64_t processed() const;
+
+private:
+  struct job
+  {
+    cv::Mat input;
+    cv::Mat output;
+    std::vector<cv::Rect> regions;
+    int64_t timestamp_us;
+    std::chrono::steady_clock::time_point deadline;
+    bool done;
+  };
+
+  void work(std::shared_ptr<job> j);
+
+  std::vector<std::unique_ptr<frame_processor>> processors;
+  work_stealing_pool *pool;
+  size_t pipeline;
+  std::chrono::milliseconds budget;
+  size_t depth;
+
+  mutable std::mutex lock;
+  std::condition_variable job_done;
+  std::deque<std::shared_ptr<job>> in_flight;
+  int outstanding;
+  uint64_t misses;
+  uint64_t completions;
+};
+
+#endif
@@ -0,0 +1,176 @@
+#include "quality.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+// frames whose packet never came back are given up on after this many newer ones
+static const size_t max_references = 64;
+
+quality_meter::quality_meter(const AVCodecContext *encoder)
+    : decoder(nullptr), decoded(av_frame_alloc()), roi_error(0), background_error(0), roi_pixels(0), background_pixels(0), frames(0), qp_sum(0),
+      qp_packets(0)
+{
+  const AVCodec *codec = avcodec_find_decoder(encoder->codec_id);
+  decoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+  if (!decoder)
+  {
+    std::cout << "Could not find a decoder to measure quality with!" << std::endl;
+    exit(1);
+  }
+
+  // with a global header the parameter sets only live in the extradata
+  if (encoder->extradata_size > 0)
+  {
+    decoder->extradata = static_cast<uint8_t *>(av_mallocz(encoder->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE));
+    memcpy(decoder->extradata, encoder->extradata, encoder->extradata_size);
+    decoder->extradata_size = encoder->extradata_size;
+  }
+  // slice threads only, frame threads would hold pictures back
+  decoder->thread_type = FF_THREAD_SLICE;
+  if (avcodec_open2(decoder, codec, nullptr) < 0)
+  {
+    std::cout << "Could not open a decoder to measure quality with!" << std::endl;
+    exit(1);
+  }
+}
+
+quality_meter::~quality_meter()
+{
+  avcodec_free_context(&decoder);
+  av_frame_free(&decoded);
+}
+
+void quality_meter::reference(const AVFrame *frame)
+{
+  reference_frame r;
+  r.pts = frame->pts;
+  r.width = frame->width;
+  r.height = frame->height;
+  r.luma.resize(static_cast<size_t>(r.width) * r.height);
+  r.mask.assign(r.luma.size(), 0);
+  for (int y = 0; y < r.height; y++)
+  {
+    memcpy(&r.luma[static_cast<size_t>(y) * r.width], frame->data[0] + y * frame->linesize[0], r.width);
+  }
+
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(56, 25, 100)
+  const AVFrameSideData *side = av_frame_get_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+  // the side data size is an int before FFmpeg 6
+  size_t side_size = side ? static_cast<size_t>(side->size) : 0;
+  if (side_size >= sizeof(AVRegionOfInterest))
+  {
+    const AVRegionOfInterest *first = reinterpret_cast<const AVRegionOfInterest *>(side->data);
+    uint32_t self_size = first->self_size ? first->self_size : sizeof(AVRegionOfInterest);
+    for (size_t offset = 0; offset + self_size <= side_size; offset += self_size)
+    {
+      const AVRegionOfInterest *roi = reinterpret_cast<const AVRegionOfInterest *>(side->data + offset);
+      int left = std::max(0, roi->left), top = std::max(0, roi->top);
+      int right = std::min(r.width, roi->right), bottom = std::min(r.height, roi->bottom);
+      if (left == 0 && top == 0 && right == r.width && bottom == r.height)
+      {
+        continue;
+      }
+      for (int y = top; y < bottom; y++)
+      {
+        if (right > left)
+        {
+          memset(&r.mask[static_cast<size_t>(y) * r.width + left], 1, right - left);
+        }
+      }
+    }
+  }
+#endif
+
+  references.push_back(std::move(r));
+  if (references.size() > max_references)
+  {
+    references.pop_front();
+  }
+}
+
+void quality_meter::packet(const AVPacket *pkt)
+{
+  // libx264 stamps every packet with its quantizer, in lambda units and little endian
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+  size_t stats_size = 0;
+#else
+  int stats_size = 0;
+#endif
+  const uint8_t *stats = av_packet_get_side_data(pkt, AV_PKT_DATA_QUALITY_STATS, &stats_size);
+  if (stats && stats_size >= 4)
+  {
+    uint32_t quality = stats[0] | stats[1] << 8 | stats[2] << 16 | static_cast<uint32_t>(stats[3]) << 24;
+    qp_sum += static_cast<double>(quality) / FF_QP2LAMBDA;
+    qp_packets++;
+  }
+
+  // the decoder takes its own reference, new extradata side data goes along with it
+  if (avcodec_send_packet(decoder, pkt) < 0)
+  {
+    return;
+  }
+  while (avcodec_receive_frame(decoder, decoded) >= 0)
+  {
+    compare(decoded);
+    av_frame_unref(decoded);
+  }
+}
+
+void quality_meter::compare(const AVFrame *picture)
+{
+  // frames come back in order, anything older than this one was lost on the way
+  while (!references.empty() && references.front().pts < picture->pts)
+  {
+    references.pop_front();
+  }
+  if (references.empty() || references.front().pts != picture->pts)
+  {
+    return;
+  }
+
+  const reference_frame &r = references.front();
+  if (r.width == picture->width && r.height == picture->height)
+  {
+    for (int y = 0; y < r.height; y++)
+    {
+      const uint8_t *a = &r.luma[static_cast<size_t>(y) * r.width];
+      const uint8_t *m = &r.mask[static_cast<size_t>(y) * r.width];
+      const uint8_t *b = picture->data[0] + y * picture->linesize[0];
+      int64_t inside = 0, outside = 0;
+      int inside_count = 0;
+      for (int x = 0; x < r.width; x++)
+      {
+        int d = a[x] - b[x];
+        if (m[x])
+        {
+          inside += d * d;
+          inside_count++;
+        }
+        else
+        {
+          outside += d * d;
+        }
+      }
+      roi_error += inside;
+      background_error += outside;
+      roi_pixels += inside_count;
+      background_pixels += r.width - inside_count;
+    }
+    frames++;
+  }
+  references.pop_front();
+}
+
+double quality_meter::psnr(double error, uint64_t pixels)
+{
+  if (!pixels)
+  {
+    return -1;
+  }
+  // identical pictures would be infinite, cap them like ffmpeg's psnr filter does
+  double mse = std::max(error / pixels, 1e-10);
+  return std::min(10 * std::log10(255.0 * 255.0 / mse), 99.0);
+}
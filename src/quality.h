@@ -0,0 +1,64 @@
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+}
+
+// measures what the encoder does to the picture, for a/b runs at a fixed --crf. the encoded packets
+// are decoded again and compared with the frames that went in, luma psnr separately inside the
+// regions of interest attached to the frame and everywhere else. a whole-frame entry does not count
+// as a region, so --roi-background does not swallow the background. the encoder's average quantizer
+// is kept as well, at a fixed bitrate a lower one means the bits went further. costs a decoder, only
+// used from the pipeline thread
+class quality_meter
+{
+public:
+  explicit quality_meter(const AVCodecContext *encoder);
+  ~quality_meter();
+
+  // a frame about to be encoded, kept until its packet comes back
+  void reference(const AVFrame *frame);
+  // a packet of the same encoder, new extradata on it is picked up
+  void packet(const AVPacket *pkt);
+
+  // in db, negative while nothing was measured
+  double roi_psnr() const { return psnr(roi_error, roi_pixels); }
+  double background_psnr() const { return psnr(background_error, background_pixels); }
+  uint64_t compared() const { return frames; }
+  // negative when the encoder does not report it
+  double average_qp() const { return qp_packets ? qp_sum / qp_packets : -1; }
+
+private:
+  struct reference_frame
+  {
+    int64_t pts;
+    int width;
+    int height;
+    std::vector<uint8_t> luma;
+    // 1 inside a region of interest
+    std::vector<uint8_t> mask;
+  };
+
+  static double psnr(double error, uint64_t pixels);
+  void compare(const AVFrame *decoded);
+
+  AVCodecContext *decoder;
+  AVFrame *decoded;
+  std::deque<reference_frame> references;
+  double roi_error;
+  double background_error;
+  uint64_t roi_pixels;
+  uint64_t background_pixels;
+  uint64_t frames;
+  double qp_sum;
+  uint64_t qp_packets;
+};
+
+#endif
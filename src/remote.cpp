@@ -0,0 +1,366 @@
+#include "remote.h"
+#include "frame-clock.h"
+#include "stage-error.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const uint32_t remote_frame_magic = 0x4d415246;
+// nothing sensible is bigger, a header claiming more is garbage
+static const uint32_t max_frame_size = 64 << 20;
+static const uint32_t max_frame_dimension = 16384;
+// how long the sender waits on a connect or on a worker that stopped reading before giving up on it.
+// the socket calls wake up every send_poll_ms to see whether we are shutting down
+static const int connect_timeout_ms = 2000;
+static const int stalled_send_timeout_ms = 5000;
+static const int send_poll_ms = 200;
+
+static std::vector<uint8_t> frame_message(remote_frame_format format, int width, int height, int64_t timestamp_us, size_t size)
+{
+  std::vector<uint8_t> message(sizeof(remote_frame_header) + size);
+  remote_frame_header header = {remote_frame_magic, format, static_cast<uint32_t>(width), static_cast<uint32_t>(height), timestamp_us,
+                                static_cast<uint32_t>(size), 0};
+  memcpy(message.data(), &header, sizeof(header));
+  return message;
+}
+
+// connects without blocking past the timeout or past shutdown, the socket stays blocking afterwards
+static int connect_with_timeout(const addrinfo *address, const std::atomic<bool> &running)
+{
+  int fd = socket(address->ai_family, SOCK_STREAM, 0);
+  if (fd < 0)
+  {
+    return -1;
+  }
+
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  bool connected = connect(fd, address->ai_addr, address->ai_addrlen) == 0;
+  for (int waited = 0; !connected && errno == EINPROGRESS && running && waited < connect_timeout_ms; waited += send_poll_ms)
+  {
+    pollfd pfd = {fd, POLLOUT, 0};
+    if (poll(&pfd, 1, send_poll_ms) > 0)
+    {
+      int error = 0;
+      socklen_t length = sizeof(error);
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+      connected = error == 0;
+      break;
+    }
+  }
+  if (!connected)
+  {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, flags);
+
+  timeval timeout = {0, send_poll_ms * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+frame_sender::frame_sender(const std::string &address, size_t queue_depth)
+    : port(0), queue_depth(queue_depth), running(true), sent_frames(0), dropped_frames(0)
+{
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos)
+  {
+    std::cout << "Give the encode worker as host:port!" << std::endl;
+    exit(1);
+  }
+  host = address.substr(0, colon);
+  port = atoi(address.c_str() + colon + 1);
+  sender = std::thread(&frame_sender::send_loop, this);
+}
+
+frame_sender::~frame_sender()
+{
+  {
+    std::lock_guard<std::mutex> l(lock);
+    running = false;
+  }
+  queued.notify_all();
+  sender.join();
+}
+
+void frame_sender::send_i420(const AVFrame *frame, int64_t timestamp_us)
+{
+  // the planes go out without their padding, one after the other
+  int width = frame->width, height = frame->height;
+  std::vector<uint8_t> message = frame_message(remote_i420, width, height, timestamp_us, width * height * 3 / 2);
+  uint8_t *out = message.data() + sizeof(remote_frame_header);
+  for (int plane = 0; plane < 3; plane++)
+  {
+    int plane_width = plane ? width / 2 : width, plane_height = plane ? height / 2 : height;
+    for (int y = 0; y < plane_height; y++, out += plane_width)
+    {
+      memcpy(out, frame->data[plane] + y * frame->linesize[plane], plane_width);
+    }
+  }
+  queue(std::move(message));
+}
+
+void frame_sender::send_jpeg(const cv::Mat &image, int quality, int64_t timestamp_us)
+{
+  std::vector<uint8_t> jpeg;
+  if (!cv::imencode(".jpg", image, jpeg, {cv::IMWRITE_JPEG_QUALITY, quality}))
+  {
+    dropped_frames++;
+    return;
+  }
+
+  std::vector<uint8_t> message = frame_message(remote_jpeg, image.cols, image.rows, timestamp_us, jpeg.size());
+  memcpy(message.data() + sizeof(remote_frame_header), jpeg.data(), jpeg.size());
+  queue(std::move(message));
+}
+
+void frame_sender::queue(std::vector<uint8_t> message)
+{
+  std::lock_guard<std::mutex> l(lock);
+  if (messages.size() >= queue_depth)
+  {
+    messages.pop_front();
+    dropped_frames++;
+  }
+  messages.push_back(std::move(message));
+  queued.notify_one();
+}
+
+void frame_sender::send_loop()
+{
+  int fd = -1;
+  int64_t backoff_ms = 100;
+  std::unique_lock<std::mutex> l(lock);
+  while (running)
+  {
+    if (fd < 0)
+    {
+      l.unlock();
+      addrinfo hints = {}, *found = nullptr;
+      hints.ai_family = AF_INET;
+      hints.ai_socktype = SOCK_STREAM;
+      if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) == 0)
+      {
+        fd = connect_with_timeout(found, running);
+        freeaddrinfo(found);
+      }
+      l.lock();
+
+      if (fd < 0)
+      {
+        queued.wait_for(l, std::chrono::milliseconds(backoff_ms), [this] { return !running; });
+        backoff_ms = std::min<int64_t>(backoff_ms * 2, 5000);
+        continue;
+      }
+      int yes = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+      backoff_ms = 100;
+      std::cout << "Connected to the encode worker at " << host << ":" << port << std::endl;
+    }
+
+    queued.wait(l, [this] { return !messages.empty() || !running; });
+    if (!running)
+    {
+      break;
+    }
+
+    // whatever piled up goes out in one call
+    std::vector<std::vector<uint8_t>> batch;
+    while (!messages.empty() && batch.size() < 16)
+    {
+      batch.push_back(std::move(messages.front()));
+      messages.pop_front();
+    }
+    l.unlock();
+
+    std::vector<iovec> iov;
+    for (std::vector<uint8_t> &m : batch)
+    {
+      iov.push_back({m.data(), m.size()});
+    }
+    bool ok = true;
+    int stalled_ms = 0;
+    for (size_t i = 0; ok && i < iov.size();)
+    {
+      // a worker that went away must not take the capture node down with a sigpipe
+      msghdr msg = {};
+      msg.msg_iov = &iov[i];
+      msg.msg_iovlen = iov.size() - i;
+      ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && running && stalled_ms < stalled_send_timeout_ms)
+      {
+        // the send timeout only makes us look at running again, a worker that stays stuck is dropped
+        stalled_ms += send_poll_ms;
+        continue;
+      }
+      if (n <= 0)
+      {
+        ok = false;
+        break;
+      }
+      for (; i < iov.size() && static_cast<size_t>(n) >= iov[i].iov_len; i++)
+      {
+        n -= iov[i].iov_len;
+      }
+      stalled_ms = 0;
+      if (i < iov.size())
+      {
+        iov[i].iov_base = static_cast<uint8_t *>(iov[i].iov_base) + n;
+        iov[i].iov_len -= n;
+      }
+    }
+
+    l.lock();
+    if (ok)
+    {
+      sent_frames += batch.size();
+    }
+    else
+    {
+      if (running)
+      {
+        std::cout << "Lost the connection to the encode worker, reconnecting" << std::endl;
+      }
+      dropped_frames += batch.size();
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+}
+
+net_frame_source::net_frame_source(const std::string &address, bool device_timestamps) : listener(-1), client(-1), device_timestamps(device_timestamps)
+{
+  size_t colon = address.rfind(':');
+  std::string host = colon == std::string::npos ? "0.0.0.0" : address.substr(0, colon);
+  int port = atoi(address.substr(colon == std::string::npos ? 0 : colon + 1).c_str());
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  int yes = 1;
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0 || inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+      setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0 || bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      listen(listener, 1) < 0)
+  {
+    if (listener >= 0)
+    {
+      close(listener);
+    }
+    throw stage_error(pipeline_stage::source, "Could not listen for capture nodes on " + address + "!");
+  }
+}
+
+net_frame_source::~net_frame_source()
+{
+  disconnect();
+  close(listener);
+}
+
+void net_frame_source::disconnect()
+{
+  if (client >= 0)
+  {
+    close(client);
+    client = -1;
+  }
+}
+
+bool net_frame_source::read_fully(void *data, size_t size)
+{
+  uint8_t *p = static_cast<uint8_t *>(data);
+  while (size > 0)
+  {
+    // a frame that has started has to arrive within a second, otherwise the node is gone
+    pollfd pfd = {client, POLLIN, 0};
+    if (poll(&pfd, 1, 1000) <= 0)
+    {
+      return false;
+    }
+    ssize_t n = recv(client, p, size, 0);
+    if (n <= 0)
+    {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool net_frame_source::read(cv::Mat &image, int64_t &timestamp_us)
+{
+  pollfd pfd = {client >= 0 ? client : listener, POLLIN, 0};
+  if (poll(&pfd, 1, 100) <= 0)
+  {
+    return false;
+  }
+  if (client < 0)
+  {
+    // one capture node at a time, a new one takes over once the old connection is gone
+    client = accept(listener, nullptr, nullptr);
+    if (client >= 0)
+    {
+      std::cout << "Capture node connected" << std::endl;
+    }
+    return false;
+  }
+
+  remote_frame_header header;
+  if (!read_fully(&header, sizeof(header)) || header.magic != remote_frame_magic || header.size > max_frame_size || !header.width || !header.height ||
+      header.width > max_frame_dimension || header.height > max_frame_dimension)
+  {
+    std::cout << "Capture node disconnected" << std::endl;
+    disconnect();
+    return false;
+  }
+
+  bool ok = false;
+  if (header.format == remote_i420 && header.width % 2 == 0 && header.height % 2 == 0 &&
+      header.size == static_cast<uint64_t>(header.width) * header.height * 3 / 2)
+  {
+    // read straight into the image, no copy after the socket
+    image = cv::Mat(header.height * 3 / 2, header.width, CV_8UC1);
+    ok = read_fully(image.data, header.size);
+  }
+  else if (header.format == remote_jpeg)
+  {
+    std::vector<uint8_t> jpeg(header.size);
+    ok = read_fully(jpeg.data(), jpeg.size());
+    if (ok)
+    {
+      image = cv::imdecode(cv::Mat(1, static_cast<int>(jpeg.size()), CV_8UC1, jpeg.data()), cv::IMREAD_COLOR);
+      ok = !image.empty();
+    }
+  }
+  if (!ok)
+  {
+    std::cout << "Capture node sent a broken frame, dropping the connection" << std::endl;
+    disconnect();
+    return false;
+  }
+
+  // the capture node's clock is not ours, with capture timestamps the frame clock slews it over
+  timestamp_us = device_timestamps ? header.timestamp_us : monotonic_time_us();
+  return true;
+}
@@ -0,0 +1,100 @@
+#ifndef REMOTE_H
+#define REMOTE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "capture.h"
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+// frames shipped from a capture node to an encode worker over tcp. every frame is a fixed header
+// followed by either planar i420 at the output size or a jpeg of the captured image. the header is
+// little endian
+enum remote_frame_format : uint32_t
+{
+  remote_i420 = 1,
+  remote_jpeg = 2
+};
+
+struct remote_frame_header
+{
+  uint32_t magic;
+  uint32_t format;
+  uint32_t width;
+  uint32_t height;
+  int64_t timestamp_us;
+  uint32_t size;
+  uint32_t reserved;
+};
+
+// the capture side. frames are queued and written out by a thread of its own, several at a time when
+// they pile up. when the network or the worker cannot keep up the oldest queued frame is dropped, so
+// capture never waits. connects again with a growing pause whenever the connection breaks or the
+// worker stops reading for a few seconds
+class frame_sender
+{
+public:
+  // host:port of the worker
+  frame_sender(const std::string &address, size_t queue_depth = 4);
+  ~frame_sender();
+
+  void send_i420(const AVFrame *frame, int64_t timestamp_us);
+  void send_jpeg(const cv::Mat &image, int quality, int64_t timestamp_us);
+
+  uint64_t sent() const { return sent_frames; }
+  uint64_t dropped() const { return dropped_frames; }
+
+private:
+  void queue(std::vector<uint8_t> message);
+  void send_loop();
+
+  std::string host;
+  int port;
+  size_t queue_depth;
+  std::thread sender;
+  std::mutex lock;
+  std::condition_variable queued;
+  std::deque<std::vector<uint8_t>> messages;
+  // changed under the lock, also read without it while a connect or a send is waiting
+  std::atomic<bool> running;
+  std::atomic<uint64_t> sent_frames;
+  std::atomic<uint64_t> dropped_frames;
+};
+
+// the worker side, listens on [host:]port and reads frames from whichever capture node connects.
+// i420 frames come out as a single channel image with the chroma planes below the luma plane, jpeg
+// frames as bgr
+class net_frame_source : public frame_source
+{
+public:
+  net_frame_source(const std::string &address, bool device_timestamps);
+  ~net_frame_source();
+
+  // waits at most a tenth of a second for a frame to start
+  bool read(cv::Mat &image, int64_t &timestamp_us) override;
+  // the capture node decides size and rate
+  void set_size(double width, double height) override {}
+  void set_fps(double fps) override {}
+
+private:
+  bool read_fully(void *data, size_t size);
+  void disconnect();
+
+  int listener;
+  int client;
+  bool device_timestamps;
+};
+
+#endif
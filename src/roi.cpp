@@ -0,0 +1,148 @@
+#include "roi.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+}
+
+// x264 takes the regions per macroblock, beyond this a bounding box does just as well
+static const size_t max_motion_regions = 32;
+
+bool parse_regions(const std::string &spec, float default_quality, std::vector<region> &regions)
+{
+  std::stringstream entries(spec);
+  std::string entry;
+  while (std::getline(entries, entry, ';'))
+  {
+    if (entry.empty())
+    {
+      continue;
+    }
+
+    region r;
+    r.quality = default_quality;
+    int n = sscanf(entry.c_str(), "%d,%d,%d,%d,%f", &r.rect.x, &r.rect.y, &r.rect.width, &r.rect.height, &r.quality);
+    if (n < 4 || r.rect.empty() || r.quality < -1 || r.quality > 1)
+    {
+      std::cout << "Invalid region of interest " << entry << "!" << std::endl;
+      return false;
+    }
+    regions.push_back(r);
+  }
+  return true;
+}
+
+void add_motion_regions(const motion_detector &motion, float quality, std::vector<region> &regions)
+{
+  const std::vector<uint8_t> &moving = motion.moving_blocks();
+  const int block = 16;
+  std::vector<cv::Rect> runs;
+  size_t previous_row_start = 0;
+
+  for (int by = 0; by < motion.blocks_y(); by++)
+  {
+    size_t row_start = runs.size();
+    for (int bx = 0; bx < motion.blocks_x(); bx++)
+    {
+      if (!moving[by * motion.blocks_x() + bx])
+      {
+        continue;
+      }
+
+      int start = bx;
+      while (bx + 1 < motion.blocks_x() && moving[by * motion.blocks_x() + bx + 1])
+      {
+        bx++;
+      }
+
+      cv::Rect run(start * block, by * block, (bx - start + 1) * block, block);
+      bool merged = false;
+      for (size_t i = previous_row_start; i < row_start; i++)
+      {
+        if (runs[i].x == run.x && runs[i].width == run.width && runs[i].y + runs[i].height == run.y)
+        {
+          runs[i].height += block;
+          merged = true;
+          break;
+        }
+      }
+      if (!merged)
+      {
+        runs.push_back(run);
+      }
+    }
+    previous_row_start = row_start;
+  }
+
+  if (runs.size() > max_motion_regions)
+  {
+    cv::Rect box = runs[0];
+    for (const cv::Rect &run : runs)
+    {
+      box = box | run;
+    }
+    runs.assign(1, box);
+  }
+
+  for (const cv::Rect &run : runs)
+  {
+    regions.push_back({run, quality});
+  }
+}
+
+void attach_regions(AVFrame *frame, const std::vector<region> &regions, float background)
+{
+  // the frame buffer is reused, so whatever the previous frame carried goes first
+  av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(56, 25, 100)
+  cv::Rect bounds(0, 0, frame->width, frame->height);
+  std::vector<AVRegionOfInterest> rois;
+  for (const region &r : regions)
+  {
+    cv::Rect rect = r.rect & bounds;
+    if (rect.empty())
+    {
+      continue;
+    }
+
+    AVRegionOfInterest roi;
+    roi.self_size = sizeof(AVRegionOfInterest);
+    roi.left = rect.x;
+    roi.top = rect.y;
+    roi.right = rect.x + rect.width;
+    roi.bottom = rect.y + rect.height;
+    roi.qoffset = av_make_q(static_cast<int>(r.quality * 1000), 1000);
+    rois.push_back(roi);
+  }
+
+  // earlier entries win where regions overlap, so the background goes last
+  if (background != 0 && !rois.empty())
+  {
+    AVRegionOfInterest roi;
+    roi.self_size = sizeof(AVRegionOfInterest);
+    roi.left = 0;
+    roi.top = 0;
+    roi.right = frame->width;
+    roi.bottom = frame->height;
+    roi.qoffset = av_make_q(static_cast<int>(background * 1000), 1000);
+    rois.push_back(roi);
+  }
+
+  if (rois.empty())
+  {
+    return;
+  }
+
+  AVFrameSideData *side = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, rois.size() * sizeof(AVRegionOfInterest));
+  if (side)
+  {
+    memcpy(side->data, rois.data(), side->size);
+  }
+#endif
+}
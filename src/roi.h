@@ -0,0 +1,34 @@
+#ifndef ROI_H
+#define ROI_H
+
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "motion.h"
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+// a part of the frame the encoder should spend more (negative quality) or fewer (positive) bits on,
+// quality has the range and meaning of AVRegionOfInterest.qoffset
+struct region
+{
+  cv::Rect rect;
+  float quality;
+};
+
+// x,y,w,h[,quality] entries separated by ';'
+bool parse_regions(const std::string &spec, float default_quality, std::vector<region> &regions);
+
+// moving blocks merged into horizontal runs, and runs with the same span merged across block rows
+void add_motion_regions(const motion_detector &motion, float quality, std::vector<region> &regions);
+
+// replaces the regions of interest on the frame, a non zero background quality covers the whole frame
+// behind them so bits move from the background into the regions
+void attach_regions(AVFrame *frame, const std::vector<region> &regions, float background);
+
+#endif
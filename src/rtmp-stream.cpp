@@ -1,9 +1,41 @@
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 #include <opencv2/highgui.hpp>
 #include <opencv2/video.hpp>
 #include "clipp.h"
+#include "audio.h"
+#include "capture.h"
+#include "control.h"
+#include "denoise.h"
+#include "dvr.h"
+#include "filter.h"
+#include "frame-clock.h"
+#include "mosaic.h"
+#include "motion.h"
+#include "overlay.h"
+#include "processing.h"
+#include "remote.h"
+#include "quality.h"
+#include "roi.h"
+#include "shm-frames.h"
+#include "shm-packets.h"
+#include "slate.h"
+#include "spool.h"
+#include "stage-error.h"
+#include "supervisor.h"
+#include "thread-pool.h"
+#include "topology.h"
 
 extern "C"
 {
@@ -11,49 +43,186 @@ extern "C"
 #include <libavcodec/avcodec.h>
 #include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
+#include <libavdevice/avdevice.h>
 }
 
 using namespace clipp;
 
-cv::VideoCapture get_device(int camID, double width, double height)
+struct stream_options
+{
+  int camera = 0;
+  // frames from another process instead of the camera
+  std::string shm;
+  // frames from a capture node on the network instead of the camera
+  std::string listen;
+  // capture only, frames go to the encode worker at this address instead of being encoded here
+  std::string send;
+  std::string send_format = "i420";
+  int send_quality = 90;
+  std::string output = "rtmp://localhost/live/stream";
+  int fps = 30;
+  int width = 800;
+  int height = 600;
+  int bitrate = 300000;
+  // constant quality instead of the average bitrate when above 0, for comparing encoder settings
+  int crf = 0;
+  // decode the stream again and print how close it stays to the input, inside and outside the regions
+  bool quality_stats = false;
+  std::string profile = "high444";
+  bool low_latency = false;
+  std::string timestamps = "wallclock";
+  bool cfr = false;
+  std::string audio = "none";
+  int audio_bitrate = 128000;
+  // inputs are resampled to these
+  int audio_rate = 44100;
+  int audio_channels = 2;
+  bool timestamp_overlay = false;
+  std::string text_overlay;
+  std::string logo_overlay;
+  std::string processor;
+  int processing_threads = 2;
+  int processing_budget = 0;
+  int idle_fps = 0;
+  int motion_threshold = 6;
+  std::string roi;
+  bool roi_motion = false;
+  float roi_quality = -0.3f;
+  float roi_background = 0;
+  int denoise = 0;
+  int denoise_threads = 2;
+  int denoise_budget = 0;
+  std::string vf;
+  int vf_threads = 0;
+  int capture_width = 0;
+  int capture_height = 0;
+  std::string crop;
+  bool yuyv = false;
+  // cameras tiled into this pipeline's output, empty for a single camera
+  std::vector<int> mosaic;
+  control_server *control = nullptr;
+  int shutdown_timeout = 3000;
+  // a camera silent for this long is reopened while a slate fills in, 0 turns the watchdog off
+  int watchdog = 2000;
+  // seconds of packets kept for clips, 0 keeps none
+  int dvr = 0;
+  std::string dvr_file;
+  // packets are spooled here and uploaded late when the first output comes back from an outage
+  std::string spool;
+  int spool_size = 256;
+  double catch_up_rate = 2;
+  std::string backfill;
+  // packets are also published to local processes through this shared memory segment
+  std::string shm_out;
+  int shm_out_size = 16;
+  // shared by all pipelines of a multi-camera run, each pipeline has its own index
+  work_stealing_pool *pool = nullptr;
+  size_t pipeline = 0;
+  // cameras streaming in this process
+  size_t cameras = 1;
+  int encoder_threads = 0;
+  // slot in the supervisor's stats segment when running as a worker process
+  worker_stats *stats = nullptr;
+  // CPUs of the pipeline's stages, empty ones are not pinned
+  pipeline_affinity affinity;
+};
+
+// set from SIGUSR1 (halve output resolution) and SIGUSR2 (restore it), picked up at the next frame boundary.
+// every pipeline compares the generation against the last one it handled
+volatile sig_atomic_t resolution_request = 0;
+std::atomic<int> resolution_generation(0);
+
+void handle_resolution_signal(int signum)
+{
+  resolution_request = signum;
+  resolution_generation++;
+}
+
+// set from SIGINT and SIGTERM, every pipeline then drains and closes its outputs. a second signal
+// kills the process the default way
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop_signal(int signum)
+{
+  stop_requested = 1;
+  std::signal(signum, SIG_DFL);
+}
+
+cv::VideoCapture get_device(int camID, double width, double height, bool raw = false)
 {
   cv::VideoCapture cam(camID);
   if (!cam.isOpened())
   {
-    std::cout << "Failed to open video capture device!" << std::endl;
-    exit(1);
+    throw stage_error(pipeline_stage::source, "Failed to open video capture device!");
   }
 
   cam.set(cv::CAP_PROP_FRAME_WIDTH, width);
   cam.set(cv::CAP_PROP_FRAME_HEIGHT, height);
+  if (raw)
+  {
+    // hand out the driver's yuyv buffers as they are, swscale converts them in the same pass as the scaling
+    cam.set(cv::CAP_PROP_CONVERT_RGB, 0);
+  }
 
   return cam;
 }
 
+bool parse_crop(const std::string &spec, cv::Rect &crop)
+{
+  if (spec.empty())
+  {
+    return true;
+  }
+
+  if (sscanf(spec.c_str(), "%d,%d,%d,%d", &crop.x, &crop.y, &crop.width, &crop.height) != 4 || crop.x < 0 || crop.y < 0 || crop.empty())
+  {
+    std::cout << "Invalid crop rectangle " << spec << "!" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+frame_source *open_camera_source(const stream_options &opts, double width, double height)
+{
+  bool device_timestamps = opts.timestamps == "capture";
+  if (!opts.listen.empty())
+  {
+    return new net_frame_source(opts.listen, device_timestamps);
+  }
+  if (!opts.shm.empty())
+  {
+    return new shm_frame_source(opts.shm, opts.yuyv);
+  }
+  if (opts.low_latency)
+  {
+    return new latest_frame_source(get_device(opts.camera, width, height, opts.yuyv), device_timestamps);
+  }
+  return new device_source(get_device(opts.camera, width, height, opts.yuyv), device_timestamps);
+}
+
 void initialize_avformat_context(AVFormatContext *&fctx, const char *format_name)
 {
   int ret = avformat_alloc_output_context2(&fctx, nullptr, format_name, nullptr);
   if (ret < 0)
   {
-    std::cout << "Could not allocate output format context!" << std::endl;
-    exit(1);
+    throw stage_error(pipeline_stage::output, "Could not allocate output format context!");
   }
 }
 
-void initialize_io_context(AVFormatContext *&fctx, const char *output)
+// opens into pb instead of the context's own, so the streams can be set up meanwhile
+void initialize_io_context(const AVFormatContext *fctx, AVIOContext *&pb, const char *output)
 {
   if (!(fctx->oformat->flags & AVFMT_NOFILE))
   {
-    int ret = avio_open2(&fctx->pb, output, AVIO_FLAG_WRITE, nullptr, nullptr);
+    int ret = avio_open2(&pb, output, AVIO_FLAG_WRITE, &fctx->interrupt_callback, nullptr);
     if (ret < 0)
     {
-      std::cout << "Could not open output IO context!" << std::endl;
-      exit(1);
+      throw stage_error(pipeline_stage::output, "Could not open output IO context!");
     }
   }
 }
 
-void set_codec_params(AVFormatContext *&fctx, AVCodecContext *&codec_ctx, double width, double height, int fps, int bitrate)
+void set_codec_params(const AVOutputFormat *oformat, AVCodecContext *&codec_ctx, double width, double height, int fps, int bitrate, int threads = 0)
 {
   const AVRational dst_fps = {fps, 1};
 
@@ -65,177 +234,2119 @@ void set_codec_params(AVFormatContext *&fctx, AVCodecContext *&codec_ctx, double
   codec_ctx->gop_size = 12;
   codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
   codec_ctx->framerate = dst_fps;
-  codec_ctx->time_base = av_inv_q(dst_fps);
+  // fine enough to carry real capture timestamps, the frame rate above is only a rate control hint
+  codec_ctx->time_base = {1, 90000};
   codec_ctx->bit_rate = bitrate;
-  if (fctx->oformat->flags & AVFMT_GLOBALHEADER)
+  // 0 lets the encoder take every core, several pipelines in one process split them instead
+  codec_ctx->thread_count = threads;
+  if (oformat->flags & AVFMT_GLOBALHEADER)
   {
     codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
   }
 }
 
-void initialize_codec_stream(AVStream *&stream, AVCodecContext *&codec_ctx, const AVCodec *&codec, std::string codec_profile)
+void open_video_encoder(AVCodecContext *&codec_ctx, const AVCodec *&codec, std::string codec_profile)
 {
-  int ret = avcodec_parameters_from_context(stream->codecpar, codec_ctx);
-  if (ret < 0)
-  {
-    std::cout << "Could not initialize stream codec parameters!" << std::endl;
-    exit(1);
-  }
-
   AVDictionary *codec_options = nullptr;
   av_dict_set(&codec_options, "profile", codec_profile.c_str(), 0);
   av_dict_set(&codec_options, "preset", "superfast", 0);
   av_dict_set(&codec_options, "tune", "zerolatency", 0);
+  // a keyframe asked for over the control socket has to be one a new viewer can start from
+  av_dict_set(&codec_options, "forced-idr", "1", 0);
+  if (codec_ctx->global_quality > 0)
+  {
+    av_dict_set_int(&codec_options, "crf", codec_ctx->global_quality / FF_QP2LAMBDA, 0);
+  }
 
   // open video encoder
-  ret = avcodec_open2(codec_ctx, codec, &codec_options);
+  int ret = avcodec_open2(codec_ctx, codec, &codec_options);
+  av_dict_free(&codec_options);
   if (ret < 0)
   {
-    std::cout << "Could not open video encoder!" << std::endl;
-    exit(1);
+    throw stage_error(pipeline_stage::encoder, "Could not open video encoder!");
+  }
+}
+
+void initialize_codec_stream(AVStream *&stream, AVCodecContext *&codec_ctx, const AVCodec *&codec, std::string codec_profile)
+{
+  open_video_encoder(codec_ctx, codec, codec_profile);
+
+  // copy parameters after the encoder is open so the stream owns its own copy of the extradata
+  int ret = avcodec_parameters_from_context(stream->codecpar, codec_ctx);
+  if (ret < 0)
+  {
+    throw stage_error(pipeline_stage::encoder, "Could not initialize stream codec parameters!");
   }
 }
 
-SwsContext *initialize_sample_scaler(AVCodecContext *codec_ctx, double width, double height)
+SwsContext *initialize_sample_scaler(SwsContext *swsctx, AVFrame *frame, double width, double height, AVPixelFormat src_format = AV_PIX_FMT_BGR24)
 {
-  SwsContext *swsctx = sws_getContext(width, height, AV_PIX_FMT_BGR24, width, height, codec_ctx->pix_fmt, SWS_BICUBIC, nullptr, nullptr, nullptr);
+  // scales from the captured frame size to the frame buffer size, reused as long as neither changes
+  swsctx = sws_getCachedContext(swsctx, width, height, src_format, frame->width, frame->height, static_cast<AVPixelFormat>(frame->format), SWS_BICUBIC,
+                                nullptr, nullptr, nullptr);
   if (!swsctx)
   {
-    std::cout << "Could not initialize sample scaler!" << std::endl;
-    exit(1);
+    throw stage_error(pipeline_stage::source, "Could not initialize sample scaler!");
+  }
+
+  return swsctx;
+}
+
+// the part of the captured image that is converted into the frame, in capture pixels. empty when the
+// crop rectangle misses the image
+cv::Rect converted_area(const cv::Mat &image, bool yuyv, double capture_width, double capture_height, const cv::Rect &crop)
+{
+  // yuyv comes either as a 2 channel image or as the flat driver buffer, planar i420 from a capture node
+  // as a single channel image with the chroma planes below the luma plane
+  int width = image.cols, height = image.rows;
+  if (yuyv && image.channels() != 2)
+  {
+    width = capture_width;
+    height = capture_height;
+  }
+  else if (!yuyv && image.channels() == 1)
+  {
+    height = image.rows * 2 / 3;
+  }
+
+  cv::Rect area(0, 0, width, height);
+  if (!crop.empty())
+  {
+    area &= crop;
+    area.x &= ~1;
+  }
+  return area;
+}
+
+SwsContext *convert_image(SwsContext *swsctx, const cv::Mat &image, bool yuyv, double capture_width, double capture_height, const cv::Rect &crop,
+                          AVFrame *frame)
+{
+  // yuyv comes either as a 2 channel image or as the flat driver buffer, depending on the backend
+  int width = image.cols, height = image.rows, stride = static_cast<int>(image.step[0]);
+  int bytes_per_pixel = 3;
+  if (yuyv)
+  {
+    bytes_per_pixel = 2;
+    if (image.channels() != 2)
+    {
+      width = capture_width;
+      height = capture_height;
+      stride = width * 2;
+      if (image.total() * image.elemSize() < static_cast<size_t>(stride) * height)
+      {
+        throw stage_error(pipeline_stage::source, "Raw capture buffer does not hold a " + std::to_string(width) + "x" + std::to_string(height) + " yuyv image!");
+      }
+    }
+  }
+
+  // planar i420 from a capture node, a single channel image with the luma plane on top
+  bool i420 = !yuyv && image.channels() == 1;
+  if (i420)
+  {
+    height = image.rows * 2 / 3;
+  }
+
+  // cropping is only a pointer offset, swscale then crops, scales and converts in a single pass over
+  // the source lines, so the cropped away part is never read
+  cv::Rect area = converted_area(image, yuyv, capture_width, capture_height, crop);
+  if (area.empty())
+  {
+    throw stage_error(pipeline_stage::source, "Crop rectangle is outside the captured image!");
+  }
+
+  if (i420)
+  {
+    // the chroma planes follow the luma plane at half the size, offsets are kept even for them
+    area.y &= ~1;
+    const uint8_t *u = image.data + height * stride, *v = u + height / 2 * stride / 2;
+    swsctx = initialize_sample_scaler(swsctx, frame, area.width, area.height & ~1, AV_PIX_FMT_YUV420P);
+    const uint8_t *src[] = {image.data + area.y * stride + area.x, u + area.y / 2 * stride / 2 + area.x / 2, v + area.y / 2 * stride / 2 + area.x / 2};
+    const int src_stride[] = {stride, stride / 2, stride / 2};
+    sws_scale(swsctx, src, src_stride, 0, area.height & ~1, frame->data, frame->linesize);
+    return swsctx;
   }
 
+  swsctx = initialize_sample_scaler(swsctx, frame, area.width, area.height, yuyv ? AV_PIX_FMT_YUYV422 : AV_PIX_FMT_BGR24);
+  const uint8_t *src[] = {image.data + area.y * stride + area.x * bytes_per_pixel};
+  const int src_stride[] = {stride};
+  sws_scale(swsctx, src, src_stride, 0, area.height, frame->data, frame->linesize);
+
   return swsctx;
 }
 
 AVFrame *allocate_frame_buffer(AVCodecContext *codec_ctx, double width, double height)
 {
   AVFrame *frame = av_frame_alloc();
-  int i = av_image_get_buffer_size(codec_ctx->pix_fmt, width, height, 1);
-  uint8_t *framebuf = new uint8_t[i];
-
-  av_image_fill_arrays(frame->data, frame->linesize, framebuf, codec_ctx->pix_fmt, width, height, 1);
   frame->width = width;
   frame->height = height;
   frame->format = static_cast<int>(codec_ctx->pix_fmt);
 
+  // reference counted, so a filter graph can hold on to it without a copy
+  if (av_frame_get_buffer(frame, 0) < 0)
+  {
+    throw stage_error(pipeline_stage::encoder, "Could not allocate frame buffer!");
+  }
+
   return frame;
 }
 
-void write_frame(AVCodecContext *codec_ctx, AVFormatContext *fmt_ctx, AVFrame *frame)
+void free_frame_buffer(AVFrame *&frame)
+{
+  av_frame_free(&frame);
+}
+
+void attach_new_extradata(AVPacket *pkt, AVCodecContext *codec_ctx)
+{
+  // the flv muxer compares this against the stream extradata and writes a new AVC sequence header in-band
+  uint8_t *side = av_packet_new_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, codec_ctx->extradata_size);
+  if (side)
+  {
+    memcpy(side, codec_ctx->extradata, codec_ctx->extradata_size);
+  }
+}
+
+struct output_set;
+
+// what an output's network calls give up at: the drain deadline of the whole set, or a deadline of
+// the output's own once it is being closed. the connection holds on to it, so it lives as long as
+// any copy of the output
+struct output_interrupt
+{
+  output_set *outputs;
+  std::atomic<int64_t> deadline_us;
+
+  explicit output_interrupt(output_set *outputs) : outputs(outputs), deadline_us(0) {}
+};
+
+// a muxer fed by the pipeline's encoders, every output has the same streams in the same order
+struct output
+{
+  std::string url;
+  AVFormatContext *fmt_ctx;
+  // outputs attached while streaming join at the next keyframe
+  bool started;
+  // a write failed, the pipeline reconnects the output at the next frame boundary
+  bool failed;
+  int64_t failed_at_us;
+  // the output the spool tracks uploads for
+  bool primary;
+  // fed from the spool until it has caught up with the live packets
+  bool catching_up;
+  std::shared_ptr<output_interrupt> interrupt;
+};
+
+// audio and video packets are muxed from their own threads, one lock covers the muxers. the list itself
+// only changes on the video thread, at frame boundaries
+struct output_set
+{
+  std::mutex lock;
+  std::vector<output> outputs;
+  // connected in the background, waiting to be attached
+  std::vector<output> connected;
+  // every output is muxed the same way, even when none is connected
+  const AVOutputFormat *format;
+  // while draining, network writes give up after this
+  std::atomic<int64_t> deadline_us;
+  // failed outputs not yet handed to the pipeline
+  std::atomic<int> failures;
+  // every packet is also kept here, whether or not an output takes it
+  dvr_ring *dvr;
+  packet_spool *spool;
+  shm_packet_publisher *shm_out;
+  // sees every frame and packet of the video encoder, not the slate
+  quality_meter *quality;
+
+  output_set() : format(nullptr), deadline_us(0), failures(0), dvr(nullptr), spool(nullptr), shm_out(nullptr), quality(nullptr) {}
+};
+
+int interrupt_after_deadline(void *opaque)
+{
+  const output_interrupt *interrupt = static_cast<const output_interrupt *>(opaque);
+  int64_t now = monotonic_time_us();
+  int64_t drain_deadline_us = interrupt->outputs->deadline_us, own_deadline_us = interrupt->deadline_us;
+  return (drain_deadline_us > 0 && now > drain_deadline_us) || (own_deadline_us > 0 && now > own_deadline_us);
+}
+
+void close_output(output &o, bool trailer)
+{
+  if (trailer)
+  {
+    av_write_trailer(o.fmt_ctx);
+  }
+  avio_closep(&o.fmt_ctx->pb);
+  avformat_free_context(o.fmt_ctx);
+  o.fmt_ctx = nullptr;
+}
+
+// false if the connection broke, a packet the muxer rejects is just lost
+bool mux_packet(output &o, int stream_index, AVRational time_base, AVPacket *pkt)
+{
+  // the muxer takes over the packet, every output gets its own reference
+  AVPacket ref = {0};
+  av_packet_ref(&ref, pkt);
+  AVStream *stream = o.fmt_ctx->streams[stream_index];
+  ref.stream_index = stream_index;
+  av_packet_rescale_ts(&ref, time_base, stream->time_base);
+  int ret = av_interleaved_write_frame(o.fmt_ctx, &ref);
+  av_packet_unref(&ref);
+
+  return ret >= 0 || !o.fmt_ctx->pb || o.fmt_ctx->pb->error >= 0;
+}
+
+void fail_output(output_set &outputs, output &o)
+{
+  o.failed = true;
+  o.failed_at_us = monotonic_time_us();
+  outputs.failures++;
+}
+
+void write_packet(AVCodecContext *codec_ctx, output_set &outputs, int stream_index, AVPacket *pkt)
+{
+  std::lock_guard<std::mutex> l(outputs.lock);
+  if (outputs.dvr)
+  {
+    outputs.dvr->add(stream_index, pkt);
+  }
+  if (outputs.shm_out)
+  {
+    outputs.shm_out->publish(stream_index, pkt);
+  }
+  uint64_t seq = outputs.spool ? outputs.spool->append(stream_index, codec_ctx->time_base, codec_ctx->codec_type, pkt) : 0;
+  for (output &o : outputs.outputs)
+  {
+    if (o.failed || o.catching_up)
+    {
+      continue;
+    }
+    if (!o.started)
+    {
+      if (codec_ctx->codec_type != AVMEDIA_TYPE_VIDEO || !(pkt->flags & AV_PKT_FLAG_KEY))
+      {
+        continue;
+      }
+      o.started = true;
+    }
+
+    if (!mux_packet(o, stream_index, codec_ctx->time_base, pkt))
+    {
+      fail_output(outputs, o);
+    }
+    else if (o.primary && outputs.spool)
+    {
+      outputs.spool->set_uploaded(seq + 1);
+    }
+  }
+}
+
+int write_frame(AVCodecContext *codec_ctx, output_set &outputs, int stream_index, AVFrame *frame, bool new_extradata = false)
 {
   AVPacket pkt = {0};
   av_new_packet(&pkt, 0);
 
+  if (outputs.quality)
+  {
+    outputs.quality->reference(frame);
+  }
   int ret = avcodec_send_frame(codec_ctx, frame);
   if (ret < 0)
   {
-    std::cout << "Error sending frame to codec context!" << std::endl;
-    exit(1);
+    throw stage_error(pipeline_stage::encoder, "Error sending frame to codec context!");
   }
 
   ret = avcodec_receive_packet(codec_ctx, &pkt);
   if (ret < 0)
   {
-    std::cout << "Error receiving packet from codec context!" << std::endl;
-    exit(1);
+    throw stage_error(pipeline_stage::encoder, "Error receiving packet from codec context!");
+  }
+
+  if (new_extradata)
+  {
+    attach_new_extradata(&pkt, codec_ctx);
+  }
+  if (outputs.quality)
+  {
+    outputs.quality->packet(&pkt);
   }
 
-  av_interleaved_write_frame(fmt_ctx, &pkt);
+  int size = pkt.size;
+  write_packet(codec_ctx, outputs, stream_index, &pkt);
   av_packet_unref(&pkt);
+
+  return size;
 }
 
-void stream_video(double width, double height, int fps, int camID, int bitrate, std::string codec_profile, std::string server)
+int flush_encoder(AVCodecContext *codec_ctx, output_set &outputs, int stream_index)
 {
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 9, 100)
-  av_register_all();
-#endif
-  avformat_network_init();
+  int flushed = 0;
+  int ret = avcodec_send_frame(codec_ctx, nullptr);
+  while (ret >= 0)
+  {
+    AVPacket pkt = {0};
+    ret = avcodec_receive_packet(codec_ctx, &pkt);
+    if (ret < 0)
+    {
+      break;
+    }
 
-  const char *output = server.c_str();
-  int ret;
-  auto cam = get_device(camID, width, height);
-  std::vector<uint8_t> imgbuf(height * width * 3 + 16);
-  cv::Mat image(height, width, CV_8UC3, imgbuf.data(), width * 3);
-  AVFormatContext *ofmt_ctx = nullptr;
-  const AVCodec *out_codec = nullptr;
-  AVStream *out_stream = nullptr;
-  AVCodecContext *out_codec_ctx = nullptr;
+    if (outputs.quality)
+    {
+      outputs.quality->packet(&pkt);
+    }
+    write_packet(codec_ctx, outputs, stream_index, &pkt);
+    av_packet_unref(&pkt);
+    flushed++;
+  }
 
-  initialize_avformat_context(ofmt_ctx, "flv");
-  initialize_io_context(ofmt_ctx, output);
+  return flushed;
+}
 
-  out_codec = avcodec_find_encoder(AV_CODEC_ID_H264);
-  out_stream = avformat_new_stream(ofmt_ctx, out_codec);
-  out_codec_ctx = avcodec_alloc_context3(out_codec);
+void reopen_video_encoder(output_set &outputs, int stream_index, AVCodecContext *&codec_ctx, const AVCodec *&codec, double width, double height,
+                          int fps, int bitrate, std::string codec_profile, int threads)
+{
+  // drain what the old encoder still holds so no frames are lost across the switch
+  flush_encoder(codec_ctx, outputs, stream_index);
+  int64_t maxrate = codec_ctx->rc_max_rate;
+  int bufsize = codec_ctx->rc_buffer_size;
+  int global_quality = codec_ctx->global_quality;
+  avcodec_free_context(&codec_ctx);
 
-  set_codec_params(ofmt_ctx, out_codec_ctx, width, height, fps, bitrate);
-  initialize_codec_stream(out_stream, out_codec_ctx, out_codec, codec_profile);
+  codec_ctx = avcodec_alloc_context3(codec);
+  set_codec_params(outputs.format, codec_ctx, width, height, fps, bitrate, threads);
+  // a vbv set over the control socket carries over, and so does constant quality
+  codec_ctx->rc_max_rate = maxrate;
+  codec_ctx->rc_buffer_size = bufsize;
+  if (global_quality > 0)
+  {
+    codec_ctx->bit_rate = 0;
+    codec_ctx->global_quality = global_quality;
+  }
+  open_video_encoder(codec_ctx, codec, codec_profile);
+  if (outputs.dvr)
+  {
+    outputs.dvr->set_stream(stream_index, codec_ctx);
+  }
 
-  out_stream->codecpar->extradata = out_codec_ctx->extradata;
-  out_stream->codecpar->extradata_size = out_codec_ctx->extradata_size;
+  // leave the stream extradata alone, the muxer replaces it when the first new packet carries the new one
+  std::lock_guard<std::mutex> l(outputs.lock);
+  if (outputs.shm_out)
+  {
+    outputs.shm_out->set_stream(stream_index, codec_ctx);
+  }
+  for (output &o : outputs.outputs)
+  {
+    o.fmt_ctx->streams[stream_index]->codecpar->width = codec_ctx->width;
+    o.fmt_ctx->streams[stream_index]->codecpar->height = codec_ctx->height;
+  }
+}
 
-  av_dump_format(ofmt_ctx, 0, output, 1);
+void reconfigure_resolution(output_set &outputs, int stream_index, AVCodecContext *&codec_ctx, const AVCodec *&codec, double width, double height,
+                            int fps, int bitrate, std::string codec_profile, int threads)
+{
+  reopen_video_encoder(outputs, stream_index, codec_ctx, codec, width, height, fps, bitrate, codec_profile, threads);
 
-  auto *swsctx = initialize_sample_scaler(out_codec_ctx, width, height);
-  auto *frame = allocate_frame_buffer(out_codec_ctx, width, height);
+  std::cout << "Output resolution changed to " << codec_ctx->width << "x" << codec_ctx->height << std::endl;
+}
 
-  int cur_size;
-  uint8_t *cur_ptr;
+// the encoders keep running, threads that connect outputs work from a copy of their parameters
+void copy_stream_params(const std::vector<AVCodecContext *> &encoders, std::vector<AVCodecParameters *> &params, std::vector<AVRational> &time_bases)
+{
+  for (AVCodecContext *encoder : encoders)
+  {
+    params.push_back(avcodec_parameters_alloc());
+    avcodec_parameters_from_context(params.back(), encoder);
+    time_bases.push_back(encoder->time_base);
+  }
+}
 
-  ret = avformat_write_header(ofmt_ctx, nullptr);
-  if (ret < 0)
+// connects o.url and writes the header, tries again with a growing pause as long as retry is set
+bool open_output(output_set &outputs, output &o, const std::vector<AVCodecParameters *> &params, const std::vector<AVRational> &time_bases, bool retry)
+{
+  int64_t backoff_ms = 500;
+  while (true)
   {
-    std::cout << "Could not write header!" << std::endl;
-    exit(1);
+    if (avformat_alloc_output_context2(&o.fmt_ctx, nullptr, "flv", nullptr) >= 0)
+    {
+      o.interrupt = std::make_shared<output_interrupt>(&outputs);
+      o.fmt_ctx->interrupt_callback = {interrupt_after_deadline, o.interrupt.get()};
+      for (size_t i = 0; i < params.size(); i++)
+      {
+        AVStream *stream = avformat_new_stream(o.fmt_ctx, nullptr);
+        avcodec_parameters_copy(stream->codecpar, params[i]);
+        stream->time_base = time_bases[i];
+      }
+
+      if (avio_open2(&o.fmt_ctx->pb, o.url.c_str(), AVIO_FLAG_WRITE, &o.fmt_ctx->interrupt_callback, nullptr) >= 0 &&
+          avformat_write_header(o.fmt_ctx, nullptr) >= 0)
+      {
+        return true;
+      }
+      close_output(o, false);
+    }
+
+    std::cout << "Could not open output " << o.url << "!" << std::endl;
+    if (!retry || stop_requested)
+    {
+      return false;
+    }
+    for (int64_t slept = 0; slept < backoff_ms && !stop_requested; slept += 100)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    backoff_ms = std::min<int64_t>(backoff_ms * 2, 5000);
   }
+}
 
-  bool end_of_stream = false;
-  do
+// a new output with the same streams as the running ones. connecting and writing the header happen on
+// their own thread so a slow server does not stall the pipeline. an output that failed while streaming
+// is retried until it comes back, a new one gets a single attempt
+std::thread connect_output(output_set &outputs, const std::string &url, const std::vector<AVCodecContext *> &encoders, int64_t failed_at_us = 0)
+{
+  std::vector<AVCodecParameters *> params;
+  std::vector<AVRational> time_bases;
+  copy_stream_params(encoders, params, time_bases);
+
+  return std::thread([&outputs, url, params, time_bases, failed_at_us] {
+    output o = {url, nullptr, false, false, failed_at_us};
+    open_output(outputs, o, params, time_bases, failed_at_us != 0);
+    for (AVCodecParameters *p : params)
+    {
+      avcodec_parameters_free(&p);
+    }
+
+    // a null context tells the pipeline the attempt is over
+    std::lock_guard<std::mutex> l(outputs.lock);
+    outputs.connected.push_back(o);
+  });
+}
+
+// holds a spooled packet back until it is due at rate times real time, 0 sends as fast as possible
+void pace_spooled(double rate, int64_t started_us, int64_t &first_us, const AVPacket *pkt, AVRational time_base)
+{
+  if (rate <= 0 || pkt->dts == AV_NOPTS_VALUE)
   {
-    cam >> image;
-    const int stride[] = {static_cast<int>(image.step[0])};
-    sws_scale(swsctx, &image.data, stride, 0, image.rows, frame->data, frame->linesize);
-    frame->pts += av_rescale_q(1, out_codec_ctx->time_base, out_stream->time_base);
-    write_frame(out_codec_ctx, ofmt_ctx, frame);
-  } while (!end_of_stream);
+    return;
+  }
 
-  av_write_trailer(ofmt_ctx);
+  int64_t dts_us = av_rescale_q(pkt->dts, time_base, {1, 1000000});
+  first_us = first_us == AV_NOPTS_VALUE ? dts_us : first_us;
+  int64_t due_us = started_us + static_cast<int64_t>((dts_us - first_us) / rate);
+  while (!stop_requested && monotonic_time_us() < due_us)
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(std::min<int64_t>(due_us - monotonic_time_us(), 100000)));
+  }
+}
 
-  av_frame_free(&frame);
-  avcodec_close(out_codec_ctx);
-  avio_close(ofmt_ctx->pb);
-  avformat_free_context(ofmt_ctx);
+// feeds a reconnected output what it missed, from the last keyframe before the first packet that did
+// not go out. the live packets keep being spooled meanwhile, once the spool is drained the output
+// switches over to them under the output lock, so nothing is lost or sent twice
+std::thread catch_up_output(output_set &outputs, const std::string &url, double rate)
+{
+  return std::thread([&outputs, url, rate] {
+    packet_spool *spool = outputs.spool;
+    uint64_t seq = spool->keyframe_before(spool->uploaded());
+    uint64_t from = seq;
+    int64_t started_us = monotonic_time_us(), first_us = AV_NOPTS_VALUE;
+    while (!stop_requested)
+    {
+      if (seq < spool->tail())
+      {
+        // overwritten before it went out, the spool is too small for the outage
+        seq = spool->keyframe_before(seq);
+      }
+
+      AVPacket pkt = {0};
+      int stream_index = 0;
+      AVRational time_base = {1, 1};
+      bool spooled = spool->read(seq, stream_index, time_base, &pkt);
+      if (spooled)
+      {
+        pace_spooled(rate, started_us, first_us, &pkt, time_base);
+      }
+
+      std::lock_guard<std::mutex> l(outputs.lock);
+      auto o = std::find_if(outputs.outputs.begin(), outputs.outputs.end(), [&url](const output &o) { return o.url == url && o.catching_up; });
+      if (o == outputs.outputs.end())
+      {
+        av_packet_unref(&pkt);
+        break;
+      }
+      if (!spooled)
+      {
+        if (seq >= spool->head())
+        {
+          o->catching_up = false;
+          std::cout << "Output " << url << " caught up after " << seq - from << " spooled packets in " << (monotonic_time_us() - started_us) / 1000
+                    << " ms" << std::endl;
+          break;
+        }
+        continue;
+      }
+
+      bool sent = mux_packet(*o, stream_index, time_base, &pkt);
+      av_packet_unref(&pkt);
+      if (!sent)
+      {
+        fail_output(outputs, *o);
+        break;
+      }
+      spool->set_uploaded(++seq);
+    }
+  });
 }
 
-int main(int argc, char *argv[])
+// sends the spooled packets from..to to an output of their own and closes it, for servers that take
+// the outage as a separate recording while the live stream goes on
+std::thread backfill_output(output_set &outputs, const std::string &url, uint64_t from, uint64_t to, const std::vector<AVCodecContext *> &encoders,
+                            double rate)
 {
-  int cameraID = 0, fps = 30, width = 800, height = 600, bitrate = 300000;
-  std::string h264profile = "high444";
-  std::string outputServer = "rtmp://localhost/live/stream";
-  bool dump_log = false;
+  std::vector<AVCodecParameters *> params;
+  std::vector<AVRational> time_bases;
+  copy_stream_params(encoders, params, time_bases);
 
-  auto cli = ((option("-c", "--camera") & value("camera", cameraID)) % "camera ID (default: 0)",
-              (option("-o", "--output") & value("output", outputServer)) % "output RTMP server (default: rtmp://localhost/live/stream)",
-              (option("-f", "--fps") & value("fps", fps)) % "frames-per-second (default: 30)",
-              (option("-w", "--width") & value("width", width)) % "video width (default: 800)",
-              (option("-h", "--height") & value("height", height)) % "video height (default: 640)",
-              (option("-b", "--bitrate") & value("bitrate", bitrate)) % "stream bitrate in kb/s (default: 300000)",
-              (option("-p", "--profile") & value("profile", h264profile)) % "H264 codec profile (baseline | high | high10 | high422 | high444 | main) (default: high444)",
-              (option("-l", "--log") & value("log", dump_log)) % "print debug output (default: false)");
+  return std::thread([&outputs, url, from, to, params, time_bases, rate] {
+    output o = {url, nullptr, false, false, 0};
+    if (open_output(outputs, o, params, time_bases, true))
+    {
+      packet_spool *spool = outputs.spool;
+      int64_t started_us = monotonic_time_us(), first_us = AV_NOPTS_VALUE;
+      uint64_t sent = 0;
+      for (uint64_t seq = spool->keyframe_before(from); seq < to && !stop_requested; seq++)
+      {
+        AVPacket pkt = {0};
+        int stream_index = 0;
+        AVRational time_base = {1, 1};
+        if (!spool->read(seq, stream_index, time_base, &pkt))
+        {
+          continue;
+        }
+        pace_spooled(rate, started_us, first_us, &pkt, time_base);
+        bool ok = mux_packet(o, stream_index, time_base, &pkt);
+        av_packet_unref(&pkt);
+        if (!ok)
+        {
+          break;
+        }
+        sent++;
+      }
 
-  if (!parse(argc, argv, cli))
+      close_output(o, true);
+      std::cout << "Backfilled " << sent << " spooled packets to " << url << std::endl;
+    }
+
+    for (AVCodecParameters *p : params)
+    {
+      avcodec_parameters_free(&p);
+    }
+  });
+}
+
+std::string pipeline_output(const std::vector<std::string> &outputs, size_t index, int camera, size_t cameras)
+{
+  if (outputs.size() == cameras)
   {
-    std::cout << make_man_page(cli, argv[0]) << std::endl;
-    return 1;
+    return outputs[index];
   }
 
-  if (dump_log)
+  // a single output is a template, %d becomes the camera ID, otherwise the ID goes in front of the
+  // extension of the last path component, or at the end without one
+  std::string output = outputs[0];
+  size_t pos = output.find("%d");
+  if (pos != std::string::npos)
   {
-    av_log_set_level(AV_LOG_DEBUG);
+    return output.replace(pos, 2, std::to_string(camera));
+  }
+  if (cameras <= 1)
+  {
+    return output;
+  }
+  size_t slash = output.rfind('/'), dot = output.rfind('.');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash) || dot == (slash == std::string::npos ? 0 : slash + 1))
+  {
+    dot = output.size();
   }
+  return output.insert(dot, "-" + std::to_string(camera));
+}
 
-  stream_video(width, height, fps, cameraID, bitrate, h264profile, outputServer);
+void stream_video(const stream_options &opts)
+{
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 9, 100)
+  av_register_all();
+#endif
+  avformat_network_init();
+
+  double width = opts.width, height = opts.height;
+  int fps = opts.fps, bitrate = opts.bitrate;
+  std::string codec_profile = opts.profile;
+  bool device_timestamps = opts.timestamps == "capture";
+  int ret;
+
+  // the camera can run in its native mode, independent of what gets encoded
+  double capture_width = opts.capture_width > 0 ? opts.capture_width : width;
+  double capture_height = opts.capture_height > 0 ? opts.capture_height : height;
+  cv::Rect crop;
+  if (!parse_crop(opts.crop, crop))
+  {
+    exit(1);
+  }
+  if (opts.yuyv && !opts.processor.empty())
+  {
+    std::cout << "Frame processing needs BGR frames and cannot be combined with yuyv capture!" << std::endl;
+    exit(1);
+  }
+  if (!opts.listen.empty() && !opts.processor.empty())
+  {
+    std::cout << "Frame processing needs BGR frames and cannot be combined with frames from a capture node!" << std::endl;
+    exit(1);
+  }
+  if (!opts.listen.empty() && opts.yuyv)
+  {
+    std::cout << "The capture node picks the pixel format, yuyv capture is set there!" << std::endl;
+    exit(1);
+  }
+  if ((!opts.shm.empty() || !opts.listen.empty()) && !opts.mosaic.empty())
+  {
+    std::cout << "The mosaic is composed from cameras and cannot take shared memory or network input!" << std::endl;
+    exit(1);
+  }
+  if (opts.yuyv && !opts.mosaic.empty())
+  {
+    std::cout << "The mosaic is composed in BGR and cannot be combined with yuyv capture!" << std::endl;
+    exit(1);
+  }
+
+  // also used by the supervisor to reopen the camera
+  double camera_width = capture_width, camera_height = capture_height;
+  auto open_camera = [&]() -> frame_source * { return open_camera_source(opts, camera_width, camera_height); };
+  auto open_source = [&]() -> frame_source * {
+    if (!opts.mosaic.empty())
+    {
+      std::vector<cv::VideoCapture> cams;
+      for (int camera : opts.mosaic)
+      {
+        cams.push_back(get_device(camera, camera_width, camera_height));
+      }
+      return new mosaic_source(cams, width, height, fps);
+    }
+    // shared memory frames are read in place and must not be held by another thread, a producer that
+    // goes away is picked up again by the source recovery. the listening socket has to outlive the
+    // capture nodes that come and go, so it is never reopened
+    if (opts.watchdog > 0 && opts.shm.empty() && opts.listen.empty())
+    {
+      return new watchdog_source(open_camera, opts.watchdog * 1000LL);
+    }
+    return open_camera();
+  };
+
+  // the camera, the connection to the server and the encoder take the longest to start and do not
+  // depend on each other, so they are opened side by side
+  int64_t startup_us = monotonic_time_us();
+  int64_t camera_us = 0, connect_us = 0, encoder_us = 0;
+  // the pipeline's own thread converts, everything else is started on the CPUs of its stage
+  set_thread_affinity(opts.affinity.convert);
+  std::future<std::unique_ptr<frame_source>> opening_source = std::async(std::launch::async, [&]() {
+    // the camera's reader threads start from here and stay on the capture CPUs
+    set_thread_affinity(opts.affinity.capture);
+    std::unique_ptr<frame_source> opened(open_source());
+    camera_us = monotonic_time_us() - startup_us;
+    return opened;
+  });
+
+  if (!opts.mosaic.empty())
+  {
+    // the capture size goes to the cameras, the mosaic itself is composed at the output size
+    capture_width = width;
+    capture_height = height;
+  }
+
+  std::vector<uint8_t> imgbuf(capture_height * capture_width * 3 + 16);
+  cv::Mat image(capture_height, capture_width, CV_8UC3, imgbuf.data(), capture_width * 3);
+  AVFormatContext *ofmt_ctx = nullptr;
+  const AVCodec *out_codec = nullptr;
+  AVStream *out_stream = nullptr;
+  AVCodecContext *out_codec_ctx = nullptr;
+
+  output_set outputs;
+  initialize_avformat_context(ofmt_ctx, "flv");
+  outputs.format = ofmt_ctx->oformat;
+  std::shared_ptr<output_interrupt> first_interrupt = std::make_shared<output_interrupt>(&outputs);
+  ofmt_ctx->interrupt_callback = {interrupt_after_deadline, first_interrupt.get()};
+  std::future<AVIOContext *> connecting_output = std::async(std::launch::async, [&]() {
+    set_thread_affinity(opts.affinity.network);
+    AVIOContext *pb = nullptr;
+    initialize_io_context(ofmt_ctx, pb, opts.output.c_str());
+    connect_us = monotonic_time_us() - startup_us;
+    return pb;
+  });
+
+  out_codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  out_stream = avformat_new_stream(ofmt_ctx, out_codec);
+  out_codec_ctx = avcodec_alloc_context3(out_codec);
+
+  // with a filter graph the encoder runs at whatever size the graph puts out
+  std::unique_ptr<filter_graph> graph;
+  AVFrame *filtered = av_frame_alloc();
+  double encoder_width = width, encoder_height = height;
+  if (!opts.vf.empty())
+  {
+    graph.reset(new filter_graph(opts.vf, width, height, {1, 90000}, {fps, 1}, opts.vf_threads));
+    encoder_width = graph->width();
+    encoder_height = graph->height();
+  }
+
+  set_codec_params(outputs.format, out_codec_ctx, encoder_width, encoder_height, fps, bitrate, opts.encoder_threads);
+  if (opts.crf > 0)
+  {
+    out_codec_ctx->bit_rate = 0;
+    out_codec_ctx->global_quality = opts.crf * FF_QP2LAMBDA;
+  }
+  {
+    // the encoder's threads are started while opening it and inherit the set
+    scoped_affinity pin(opts.affinity.encode);
+    initialize_codec_stream(out_stream, out_codec_ctx, out_codec, codec_profile);
+  }
+
+  std::unique_ptr<quality_meter> quality;
+  if (opts.quality_stats)
+  {
+    quality.reset(new quality_meter(out_codec_ctx));
+    outputs.quality = quality.get();
+  }
+
+  // encoded up front with an encoder of its own, so a stalled camera costs no encoding at all
+  std::unique_ptr<slate> offline_slate;
+  auto make_slate = [&]() {
+    AVCodecContext *slate_ctx = avcodec_alloc_context3(out_codec);
+    set_codec_params(outputs.format, slate_ctx, out_codec_ctx->width, out_codec_ctx->height, fps, bitrate, 1);
+    try
+    {
+      open_video_encoder(slate_ctx, out_codec, codec_profile);
+      offline_slate.reset(new slate(slate_ctx, "camera offline"));
+    }
+    catch (const stage_error &)
+    {
+      avcodec_free_context(&slate_ctx);
+      throw;
+    }
+    avcodec_free_context(&slate_ctx);
+  };
+  if (opts.watchdog > 0 && opts.mosaic.empty() && opts.shm.empty())
+  {
+    make_slate();
+  }
+  encoder_us = monotonic_time_us() - startup_us;
+
+  ofmt_ctx->pb = connecting_output.get();
+  std::unique_ptr<frame_source> source = opening_source.get();
+
+  std::unique_ptr<audio_source> audio_in(create_audio_source(opts.audio, opts.audio_rate, opts.audio_channels));
+  std::unique_ptr<audio_encoder> audio_out;
+  if (audio_in)
+  {
+    scoped_affinity pin(opts.affinity.network);
+    audio_out.reset(new audio_encoder(ofmt_ctx, opts.audio_rate, opts.audio_channels, opts.audio_bitrate));
+  }
+
+  av_dump_format(ofmt_ctx, 0, opts.output.c_str(), 1);
+
+  SwsContext *swsctx = nullptr;
+  auto *frame = allocate_frame_buffer(out_codec_ctx, width, height);
+  bool new_extradata = false;
+  frame_clock clock(out_codec_ctx->time_base, fps, opts.cfr, device_timestamps);
+  int64_t frame_count = 0;
+  int64_t frame_base_pts = 0;
+
+  overlay overlays;
+  overlays.set_timestamp(opts.timestamp_overlay);
+  overlays.set_text(opts.text_overlay);
+  if (!opts.logo_overlay.empty() && !overlays.set_logo(opts.logo_overlay))
+  {
+    exit(1);
+  }
+
+  std::signal(SIGUSR1, handle_resolution_signal);
+  std::signal(SIGUSR2, handle_resolution_signal);
+  int resolution_seen = resolution_generation;
+
+  ret = avformat_write_header(ofmt_ctx, nullptr);
+  if (ret < 0)
+  {
+    throw stage_error(pipeline_stage::output, "Could not write header!");
+  }
+  int64_t header_us = monotonic_time_us() - startup_us;
+
+  // from here on the first output is only one of the set, outputs can come and go
+  outputs.outputs.push_back({opts.output, ofmt_ctx, true, false, 0, true, false, first_interrupt});
+  int video_index = out_stream->index;
+
+  std::unique_ptr<dvr_ring> dvr;
+  std::vector<std::thread> exporting;
+  if (opts.dvr > 0)
+  {
+    // twice the configured rates plus some slack, a bitrate raised later evicts by size instead of age
+    size_t capacity = static_cast<size_t>(opts.dvr) * (bitrate + (audio_out ? opts.audio_bitrate : 0)) / 4 + (4 << 20);
+    dvr.reset(new dvr_ring(opts.dvr, capacity, opts.dvr_file));
+    dvr->set_stream(video_index, out_codec_ctx);
+    if (audio_out)
+    {
+      dvr->set_stream(audio_out->stream->index, audio_out->codec_ctx);
+    }
+    outputs.dvr = dvr.get();
+  }
+
+  std::unique_ptr<shm_packet_publisher> shm_out;
+  if (!opts.shm_out.empty())
+  {
+    shm_out.reset(new shm_packet_publisher(opts.shm_out, static_cast<size_t>(opts.shm_out_size) << 20));
+    shm_out->set_stream(video_index, out_codec_ctx);
+    if (audio_out)
+    {
+      shm_out->set_stream(audio_out->stream->index, audio_out->codec_ctx);
+    }
+    outputs.shm_out = shm_out.get();
+  }
+
+  std::unique_ptr<packet_spool> spool;
+  std::vector<std::thread> uploading;
+  if (!opts.spool.empty())
+  {
+    spool.reset(new packet_spool(opts.spool, static_cast<size_t>(opts.spool_size) << 20));
+    outputs.spool = spool.get();
+
+    // what an earlier run spooled but never got out, its timestamps only fit a separate output
+    uint64_t left = spool->head() - std::max(spool->uploaded(), spool->tail());
+    if (left > 0 && !opts.backfill.empty())
+    {
+      std::vector<AVCodecContext *> encoders = {out_codec_ctx};
+      if (audio_out)
+      {
+        encoders.push_back(audio_out->codec_ctx);
+      }
+      scoped_affinity pin(opts.affinity.network);
+      uploading.push_back(backfill_output(outputs, opts.backfill, spool->uploaded(), spool->head(), encoders, opts.catch_up_rate));
+    }
+    else if (left > 0)
+    {
+      std::cout << left << " packets spooled by an earlier run were never uploaded, --backfill sends them" << std::endl;
+    }
+  }
+  std::vector<std::thread> connecting;
+  std::vector<std::thread> closing;
+  std::atomic<bool> paused(false);
+  bool force_keyframe = false;
+
+  // audio and video timestamps both count from here
+  int64_t epoch_us = monotonic_time_us();
+  clock.set_origin(epoch_us);
+  if (audio_out)
+  {
+    audio_encoder *enc = audio_out.get();
+    audio_out->start(audio_in.get(), epoch_us, [enc, &outputs, &paused](AVPacket *pkt) {
+      if (!paused)
+      {
+        write_packet(enc->codec_ctx, outputs, enc->stream->index, pkt);
+      }
+    });
+  }
+
+  // a single camera gets a pool of its own for processing and denoising
+  work_stealing_pool *pool = opts.pool;
+  std::unique_ptr<work_stealing_pool> own_pool;
+  if (!pool && (!opts.processor.empty() || opts.denoise > 0))
+  {
+    own_pool.reset(new work_stealing_pool());
+    pool = own_pool.get();
+  }
+
+  std::unique_ptr<processing_stage> processing;
+  cv::Mat processed;
+  if (!opts.processor.empty())
+  {
+    int budget_ms = opts.processing_budget > 0 ? opts.processing_budget : 1000 / fps;
+    processing.reset(new processing_stage(opts.processor, opts.processing_threads, budget_ms, pool, opts.pipeline));
+  }
+
+  std::unique_ptr<motion_detector> motion;
+  if (opts.idle_fps > 0 || opts.roi_motion)
+  {
+    // without an idle rate the detector only feeds regions of interest and never skips a frame
+    motion.reset(new motion_detector(fps, opts.idle_fps, opts.motion_threshold));
+  }
+
+  std::unique_ptr<temporal_denoiser> denoiser;
+  if (opts.denoise > 0)
+  {
+    // by default a quarter of the frame interval, the encoder needs the rest
+    int64_t budget_us = opts.denoise_budget > 0 ? opts.denoise_budget * 1000 : 250000 / fps;
+    denoiser.reset(new temporal_denoiser(opts.denoise, opts.denoise_threads, budget_us, pool, opts.pipeline));
+  }
+
+  std::vector<region> static_regions;
+  if (!parse_regions(opts.roi, opts.roi_quality, static_regions))
+  {
+    exit(1);
+  }
+  bool use_regions = !static_regions.empty() || opts.roi_motion || processing;
+  if (use_regions && graph && graph->changes_geometry())
+  {
+    // the regions are placed on the frame before the graph, which would move the picture under them
+    if (!static_regions.empty() || opts.roi_motion)
+    {
+      std::cout << "Regions of interest cannot be combined with a --vf graph that scales, crops or moves the picture, use --crop and the output size "
+                   "instead!"
+                << std::endl;
+      exit(1);
+    }
+    std::cout << "Detections are not passed on as regions of interest, the --vf graph moves the picture" << std::endl;
+    use_regions = false;
+  }
+  std::vector<region> regions;
+  std::vector<cv::Rect> detected;
+  uint64_t video_bytes = 0;
+  uint64_t video_frames = 0;
+  int64_t first_packet_us = 0;
+  auto frame_sent = [&]() {
+    video_frames++;
+    first_packet_us = first_packet_us ? first_packet_us : monotonic_time_us() - startup_us;
+  };
+
+  // encodes whatever the filter graph has ready
+  auto encode_filtered = [&]() {
+    while (graph->pull(filtered))
+    {
+      filtered->pts = av_rescale_q(filtered->pts, graph->time_base(), out_codec_ctx->time_base);
+      filtered->pict_type = force_keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+      video_bytes += write_frame(out_codec_ctx, outputs, video_index, filtered, new_extradata);
+      frame_sent();
+      new_extradata = false;
+      force_keyframe = false;
+      av_frame_unref(filtered);
+    }
+  };
+
+  auto encode_image = [&](const cv::Mat &img, int64_t timestamp_us) {
+    int copies = 1;
+    if (opts.timestamps != "frames")
+    {
+      copies = clock.schedule(timestamp_us);
+      if (copies == 0)
+      {
+        return;
+      }
+    }
+
+    if (paused)
+    {
+      clock.skip(copies);
+      frame_count += copies;
+      return;
+    }
+
+    // the filter graph may still hold a reference to the last frame
+    av_frame_make_writable(frame);
+    if (opts.pool)
+    {
+      // with many cameras the shared pool bounds how many conversions run at once
+      opts.pool->run(opts.pipeline, [&] { swsctx = convert_image(swsctx, img, opts.yuyv, capture_width, capture_height, crop, frame); });
+    }
+    else
+    {
+      swsctx = convert_image(swsctx, img, opts.yuyv, capture_width, capture_height, crop, frame);
+    }
+
+    if (denoiser)
+    {
+      denoiser->apply(frame);
+    }
+
+    if (motion && !motion->should_encode(frame, timestamp_us))
+    {
+      clock.skip(copies);
+      frame_count += copies;
+      return;
+    }
+
+    overlays.apply(frame);
+
+    if (use_regions)
+    {
+      regions = static_regions;
+      // detections are in capture coordinates, the frame shows the cropped part at the output size
+      cv::Rect area = converted_area(img, opts.yuyv, capture_width, capture_height, crop);
+      for (const cv::Rect &r : detected)
+      {
+        regions.push_back({cv::Rect((r.x - area.x) * frame->width / area.width, (r.y - area.y) * frame->height / area.height,
+                                    r.width * frame->width / area.width, r.height * frame->height / area.height),
+                           opts.roi_quality});
+      }
+      if (opts.roi_motion)
+      {
+        add_motion_regions(*motion, opts.roi_quality, regions);
+      }
+      attach_regions(frame, regions, opts.roi_background);
+    }
+
+    for (int i = 0; i < copies; i++)
+    {
+      frame->pts = opts.timestamps == "frames" ? frame_base_pts + av_rescale_q(frame_count++, av_inv_q(out_codec_ctx->framerate), out_codec_ctx->time_base)
+                                               : clock.next_pts();
+      if (!graph)
+      {
+        frame->pict_type = force_keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        video_bytes += write_frame(out_codec_ctx, outputs, video_index, frame, new_extradata);
+        frame_sent();
+        new_extradata = false;
+        force_keyframe = false;
+        continue;
+      }
+
+      graph->push(frame);
+      encode_filtered();
+    }
+  };
+
+  auto current_encoders = [&]() {
+    std::vector<AVCodecContext *> encoders = {out_codec_ctx};
+    if (audio_out)
+    {
+      encoders.push_back(audio_out->codec_ctx);
+    }
+    return encoders;
+  };
+
+  // changes from the control socket, applied between two frames
+  size_t control_seen = 0;
+  std::vector<control_request> requests;
+  int pending_outputs = 0;
+  auto apply_control = [&](const control_request &r) {
+    if (r.bitrate > 0)
+    {
+      // libx264 reconfigures rate control with the next frame, vbv only if it was on from the start
+      bitrate = r.bitrate;
+      out_codec_ctx->bit_rate = r.bitrate;
+      // a vbv limit left out of the command stays as it was
+      if (r.maxrate > 0)
+      {
+        out_codec_ctx->rc_max_rate = r.maxrate;
+      }
+      if (r.bufsize > 0)
+      {
+        out_codec_ctx->rc_buffer_size = r.bufsize;
+      }
+    }
+    if (r.fps > 0 && r.fps != fps)
+    {
+      frame_base_pts += av_rescale_q(frame_count, av_inv_q(out_codec_ctx->framerate), out_codec_ctx->time_base);
+      frame_count = 0;
+      fps = r.fps;
+      out_codec_ctx->framerate = {fps, 1};
+      clock.set_fps(fps);
+      source->set_fps(fps);
+    }
+    if (r.pause >= 0 && r.pause != paused)
+    {
+      paused = r.pause;
+      // players that come back need something to start decoding from
+      force_keyframe = force_keyframe || !paused;
+    }
+    force_keyframe = force_keyframe || r.keyframe;
+
+    if (!r.add_output.empty())
+    {
+      scoped_affinity pin(opts.affinity.network);
+      std::thread t = connect_output(outputs, r.add_output, current_encoders());
+      if (t.joinable())
+      {
+        connecting.push_back(std::move(t));
+        pending_outputs++;
+      }
+    }
+    if (!r.clip_path.empty() && dvr)
+    {
+      // remuxed on a thread of its own, the ring is only locked while the packets are copied out
+      int64_t now = monotonic_time_us();
+      int64_t from_us = now - static_cast<int64_t>(r.clip_from * 1000000), to_us = now - static_cast<int64_t>(r.clip_to * 1000000);
+      // a clip asked of every pipeline is a template like the outputs, so the cameras do not share a file
+      std::string path = pipeline_output({r.clip_path}, 0, opts.camera, r.camera < 0 ? opts.cameras : 1);
+      dvr_ring *ring = dvr.get();
+      scoped_affinity pin(opts.affinity.network);
+      exporting.push_back(std::thread([ring, from_us, to_us, path] {
+        int packets = ring->export_clip(from_us, to_us, path);
+        if (packets < 0)
+        {
+          std::cout << "Could not export a clip to " << path << "!" << std::endl;
+          return;
+        }
+        std::cout << "Exported " << packets << " packets to " << path << std::endl;
+      }));
+    }
+    if (!r.remove_output.empty())
+    {
+      output removed = {};
+      {
+        std::lock_guard<std::mutex> l(outputs.lock);
+        for (size_t i = 0; i < outputs.outputs.size(); i++)
+        {
+          if (outputs.outputs[i].url != r.remove_output)
+          {
+            continue;
+          }
+          if (outputs.outputs.size() == 1)
+          {
+            std::cout << "Not removing " << r.remove_output << ", it is the last output!" << std::endl;
+            break;
+          }
+          removed = outputs.outputs[i];
+          outputs.outputs.erase(outputs.outputs.begin() + i);
+          break;
+        }
+      }
+      if (removed.fmt_ctx)
+      {
+        // the trailer goes out on a thread of its own and is given up on after the shutdown timeout, so a
+        // stalled server holds up neither the muxers nor the pipeline
+        removed.interrupt->deadline_us = monotonic_time_us() + opts.shutdown_timeout * 1000LL;
+        scoped_affinity pin(opts.affinity.network);
+        closing.push_back(std::thread([removed]() mutable { close_output(removed, true); }));
+      }
+    }
+  };
+
+  int64_t stats_at_us = epoch_us;
+  uint64_t stats_bytes = 0;
+  auto publish_stats = [&]() {
+    int64_t now = monotonic_time_us();
+    std::ostringstream json;
+    json << "{\"camera\":" << opts.camera << ",\"outputs\":[";
+    {
+      std::lock_guard<std::mutex> l(outputs.lock);
+      for (size_t i = 0; i < outputs.outputs.size(); i++)
+      {
+        json << (i ? "," : "") << "\"" << outputs.outputs[i].url << "\"";
+      }
+    }
+    json << "],\"width\":" << out_codec_ctx->width << ",\"height\":" << out_codec_ctx->height << ",\"fps\":" << fps << ",\"bitrate\":" << bitrate
+         << ",\"paused\":" << (paused ? "true" : "false") << ",\"frames\":" << video_frames
+         << ",\"kbps\":" << (video_bytes - stats_bytes) * 8000 / std::max<int64_t>(1, now - stats_at_us) << ",\"dropped\":" << clock.dropped()
+         << ",\"duplicated\":" << clock.duplicated() << ",\"skipped\":" << source->skipped() + (motion ? motion->skipped() : 0) << "}";
+    opts.control->publish_stats(opts.camera, json.str());
+    stats_at_us = now;
+    stats_bytes = video_bytes;
+  };
+
+  // restarts only the stage that failed, everything else keeps its state
+  struct recovery_stats
+  {
+    uint64_t count;
+    int64_t total_us;
+    int64_t worst_us;
+  };
+  recovery_stats recoveries[3] = {};
+  auto record_recovery = [&](pipeline_stage stage, int64_t elapsed_us) {
+    recovery_stats &r = recoveries[static_cast<int>(stage)];
+    r.count++;
+    r.total_us += elapsed_us;
+    r.worst_us = std::max(r.worst_us, elapsed_us);
+    std::cout << "Recovered the " << stage_name(stage) << " in " << elapsed_us / 1000 << " ms" << std::endl;
+  };
+
+  // while the watchdog reports the camera offline the slate goes out at the frame rate, with
+  // timestamps from the same clock the camera frames use
+  bool on_slate = false;
+  int64_t slate_due_us = 0;
+  uint64_t slate_frames = 0;
+  auto send_slate = [&]() {
+    int64_t now = monotonic_time_us();
+    if (!on_slate)
+    {
+      // only without one made up front, resizes keep it at the encoder's size
+      if (!offline_slate)
+      {
+        make_slate();
+      }
+      offline_slate->rewind();
+      on_slate = true;
+      slate_due_us = now;
+      std::cout << "Camera offline, sending the slate" << std::endl;
+    }
+
+    slate_due_us = std::max(slate_due_us, now - 1000000);
+    for (; slate_due_us <= now; slate_due_us += 1000000 / fps)
+    {
+      int copies = opts.timestamps == "frames" ? 1 : clock.schedule_monotonic(slate_due_us);
+      if (paused)
+      {
+        clock.skip(copies);
+        frame_count += copies;
+        continue;
+      }
+
+      for (int i = 0; i < copies; i++)
+      {
+        AVPacket pkt = {0};
+        offline_slate->next(&pkt, opts.timestamps == "frames" ? frame_base_pts + av_rescale_q(frame_count++, av_inv_q(out_codec_ctx->framerate),
+                                                                                                 out_codec_ctx->time_base)
+                                                              : clock.next_pts());
+        video_bytes += pkt.size;
+        write_packet(out_codec_ctx, outputs, video_index, &pkt);
+        av_packet_unref(&pkt);
+        slate_frames++;
+      }
+    }
+  };
+
+  // the supervisor reads these without asking, a restarted worker carries on from its predecessor's counts
+  uint64_t stats_frames = opts.stats ? opts.stats->frames.load(std::memory_order_relaxed) : 0;
+  uint64_t stats_bytes_sent = opts.stats ? opts.stats->bytes.load(std::memory_order_relaxed) : 0;
+  uint64_t stats_dropped = opts.stats ? opts.stats->dropped.load(std::memory_order_relaxed) : 0;
+  uint64_t stats_duplicated = opts.stats ? opts.stats->duplicated.load(std::memory_order_relaxed) : 0;
+  uint64_t stats_slate = opts.stats ? opts.stats->slate_frames.load(std::memory_order_relaxed) : 0;
+  auto publish_worker_stats = [&]() {
+    opts.stats->heartbeat_us.store(monotonic_time_us(), std::memory_order_relaxed);
+    opts.stats->frames.store(stats_frames + video_frames, std::memory_order_relaxed);
+    opts.stats->bytes.store(stats_bytes_sent + video_bytes, std::memory_order_relaxed);
+    opts.stats->dropped.store(stats_dropped + clock.dropped(), std::memory_order_relaxed);
+    opts.stats->duplicated.store(stats_duplicated + clock.duplicated(), std::memory_order_relaxed);
+    opts.stats->slate_frames.store(stats_slate + slate_frames, std::memory_order_relaxed);
+  };
+
+  int64_t read_failing_since_us = 0;
+  auto recover = [&](const stage_error &e) {
+    std::cout << e.what() << " Restarting the " << stage_name(e.stage) << std::endl;
+    int64_t started_us = monotonic_time_us();
+    int64_t backoff_ms = 100;
+    while (!stop_requested)
+    {
+      if (opts.stats)
+      {
+        // still alive, only waiting for the camera
+        publish_worker_stats();
+      }
+      try
+      {
+        if (e.stage == pipeline_stage::source)
+        {
+          // the old device has to let go before it can be opened again
+          source.reset();
+          scoped_affinity pin(opts.affinity.capture);
+          source.reset(open_source());
+        }
+        else if (e.stage == pipeline_stage::encoder)
+        {
+          int encoder_width = out_codec_ctx->width, encoder_height = out_codec_ctx->height;
+          if (graph)
+          {
+            // the graph may be the part that failed, it starts over at the size frames are converted to
+            graph.reset(new filter_graph(opts.vf, frame->width, frame->height, out_codec_ctx->time_base, out_codec_ctx->framerate, opts.vf_threads));
+            encoder_width = graph->width();
+            encoder_height = graph->height();
+          }
+          scoped_affinity pin(opts.affinity.encode);
+          reopen_video_encoder(outputs, video_index, out_codec_ctx, out_codec, encoder_width, encoder_height, fps, bitrate, codec_profile,
+                               opts.encoder_threads);
+          new_extradata = true;
+          if (offline_slate && (offline_slate->width() != out_codec_ctx->width || offline_slate->height() != out_codec_ctx->height))
+          {
+            make_slate();
+          }
+        }
+        record_recovery(e.stage, monotonic_time_us() - started_us);
+        return;
+      }
+      catch (const stage_error &again)
+      {
+        std::cout << again.what() << std::endl;
+      }
+
+      for (int64_t slept = 0; slept < backoff_ms && !stop_requested; slept += 10)
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      backoff_ms = std::min<int64_t>(backoff_ms * 2, 5000);
+    }
+  };
+
+  bool startup_reported = false;
+  int64_t spool_flushed_us = 0;
+  bool end_of_stream = false;
+  do
+  {
+    if (stop_requested)
+    {
+      end_of_stream = true;
+      continue;
+    }
+
+    if (!startup_reported && first_packet_us)
+    {
+      startup_reported = true;
+      std::cout << "First packet after " << first_packet_us / 1000 << " ms: camera ready at " << camera_us / 1000 << " ms, connected at "
+                << connect_us / 1000 << " ms, encoder ready at " << encoder_us / 1000 << " ms, header written at " << header_us / 1000 << " ms"
+                << std::endl;
+    }
+
+    if (opts.control)
+    {
+      if (opts.control->poll(opts.camera, control_seen, requests))
+      {
+        for (const control_request &r : requests)
+        {
+          apply_control(r);
+        }
+      }
+      if (monotonic_time_us() - stats_at_us >= 1000000)
+      {
+        publish_stats();
+      }
+    }
+
+    if (opts.stats)
+    {
+      publish_worker_stats();
+    }
+
+    if (spool && monotonic_time_us() - spool_flushed_us >= 1000000)
+    {
+      spool->flush();
+      spool_flushed_us = monotonic_time_us();
+    }
+
+    if (outputs.failures > 0)
+    {
+      // broken outputs reconnect in the background, the others keep streaming
+      std::lock_guard<std::mutex> l(outputs.lock);
+      for (size_t i = 0; i < outputs.outputs.size();)
+      {
+        output &o = outputs.outputs[i];
+        if (!o.failed)
+        {
+          i++;
+          continue;
+        }
+
+        std::cout << "Output " << o.url << " failed, reconnecting" << std::endl;
+        {
+          scoped_affinity pin(opts.affinity.network);
+          connecting.push_back(connect_output(outputs, o.url, current_encoders(), o.failed_at_us));
+        }
+        pending_outputs++;
+        close_output(o, false);
+        outputs.outputs.erase(outputs.outputs.begin() + i);
+        outputs.failures--;
+      }
+    }
+
+    if (pending_outputs > 0)
+    {
+      // outputs that finished connecting join the set
+      std::lock_guard<std::mutex> l(outputs.lock);
+      for (output &o : outputs.connected)
+      {
+        if (o.fmt_ctx)
+        {
+          if (o.failed_at_us)
+          {
+            record_recovery(pipeline_stage::output, monotonic_time_us() - o.failed_at_us);
+            o.failed_at_us = 0;
+          }
+
+          // what the first output missed while it was away is sent late, either in front of the live
+          // packets or to the backfill output
+          o.primary = o.url == opts.output;
+          if (o.primary && spool && opts.backfill.empty())
+          {
+            o.started = true;
+            o.catching_up = true;
+            scoped_affinity pin(opts.affinity.network);
+            uploading.push_back(catch_up_output(outputs, o.url, opts.catch_up_rate));
+          }
+          else if (o.primary && spool)
+          {
+            scoped_affinity pin(opts.affinity.network);
+            uploading.push_back(backfill_output(outputs, opts.backfill, spool->uploaded(), spool->head(), current_encoders(), opts.catch_up_rate));
+          }
+          outputs.outputs.push_back(o);
+        }
+        pending_outputs--;
+      }
+      outputs.connected.clear();
+    }
+
+    try
+    {
+      if (resolution_generation != resolution_seen)
+      {
+        // keep dimensions even, yuv420p cannot represent odd sizes
+        resolution_seen = resolution_generation;
+        int scale = resolution_request == SIGUSR1 ? 2 : 1;
+        int new_width = static_cast<int>(width) / scale & ~1;
+        int new_height = static_cast<int>(height) / scale & ~1;
+
+        if (new_width != frame->width || new_height != frame->height)
+        {
+          // a camera with its own capture size stays in that mode, only the conversion target changes
+          if (opts.capture_width <= 0 && opts.capture_height <= 0)
+          {
+            source->set_size(new_width, new_height);
+          }
+
+          int encoder_width = new_width, encoder_height = new_height;
+          if (graph)
+          {
+            // what the old graph still holds goes out at the old size, before the encoder changes
+            graph->push(nullptr);
+            encode_filtered();
+            graph.reset(new filter_graph(opts.vf, new_width, new_height, out_codec_ctx->time_base, out_codec_ctx->framerate, opts.vf_threads));
+            encoder_width = graph->width();
+            encoder_height = graph->height();
+          }
+
+          if (encoder_width != out_codec_ctx->width || encoder_height != out_codec_ctx->height)
+          {
+            scoped_affinity pin(opts.affinity.encode);
+            reconfigure_resolution(outputs, video_index, out_codec_ctx, out_codec, encoder_width, encoder_height, fps, bitrate, codec_profile,
+                                   opts.encoder_threads);
+            new_extradata = true;
+            // the slate follows now, a camera going offline later must not wait for an encode
+            if (offline_slate)
+            {
+              make_slate();
+            }
+          }
+
+          free_frame_buffer(frame);
+          frame = allocate_frame_buffer(out_codec_ctx, new_width, new_height);
+        }
+      }
+
+      int64_t timestamp_us;
+      if (!source->read(image, timestamp_us))
+      {
+        watchdog_source *watchdog = dynamic_cast<watchdog_source *>(source.get());
+        if (watchdog)
+        {
+          // the watchdog reopens the camera on its own
+          if (watchdog->offline())
+          {
+            send_slate();
+          }
+          continue;
+        }
+
+        // short hiccups are ridden out, a camera that stays silent is reopened
+        int64_t now = monotonic_time_us();
+        read_failing_since_us = read_failing_since_us ? read_failing_since_us : now;
+        if (!opts.listen.empty())
+        {
+          // the read already waited, the listener keeps waiting for a capture node with the slate on air
+          if (opts.watchdog > 0 && now - read_failing_since_us > opts.watchdog * 1000LL)
+          {
+            send_slate();
+          }
+          continue;
+        }
+        if (now - read_failing_since_us > 1000000)
+        {
+          read_failing_since_us = 0;
+          throw stage_error(pipeline_stage::source, "Camera stopped delivering frames!");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        continue;
+      }
+      read_failing_since_us = 0;
+      if (on_slate)
+      {
+        // the decoders have to switch back to the camera's sequence header at a keyframe
+        on_slate = false;
+        force_keyframe = true;
+        new_extradata = true;
+        std::cout << "Camera back after " << slate_frames << " slate frames" << std::endl;
+      }
+
+      if (!processing)
+      {
+        encode_image(image, timestamp_us);
+        continue;
+      }
+
+      // keep the workers busy with several frames and only block once all of them are taken
+      processing->submit(image, timestamp_us);
+      while (processing->next(processed, timestamp_us, detected, processing->full()))
+      {
+        encode_image(processed, timestamp_us);
+      }
+    }
+    catch (const stage_error &e)
+    {
+      recover(e);
+    }
+  } while (!end_of_stream);
+
+  // stop capturing, then push everything still in flight through to the outputs. writes that
+  // block past the deadline are abandoned so a dead server cannot hold up the exit
+  int64_t drain_started_us = monotonic_time_us();
+  outputs.deadline_us = drain_started_us + opts.shutdown_timeout * 1000LL;
+  uint64_t source_skipped = source ? source->skipped() : 0;
+  watchdog_source *watchdog = dynamic_cast<watchdog_source *>(source.get());
+  uint64_t camera_reopens = watchdog ? watchdog->reopens() : 0;
+  source.reset();
+
+  uint64_t frames_before_drain = video_frames;
+  if (processing)
+  {
+    int64_t timestamp_us;
+    while (processing->next(processed, timestamp_us, detected, true))
+    {
+      encode_image(processed, timestamp_us);
+    }
+  }
+  if (graph)
+  {
+    graph->push(nullptr);
+    encode_filtered();
+  }
+  int flushed_packets = flush_encoder(out_codec_ctx, outputs, video_index);
+
+  // the audio encoder drains itself once its thread stops
+  if (audio_out)
+  {
+    audio_out->stop();
+  }
+
+  for (std::thread &t : connecting)
+  {
+    t.join();
+  }
+  for (std::thread &t : closing)
+  {
+    t.join();
+  }
+  for (std::thread &t : exporting)
+  {
+    t.join();
+  }
+  for (std::thread &t : uploading)
+  {
+    t.join();
+  }
+  for (output &o : outputs.connected)
+  {
+    if (o.fmt_ctx)
+    {
+      outputs.outputs.push_back(o);
+    }
+  }
+  // the trailer also writes out what the interleaving queue still holds
+  for (output &o : outputs.outputs)
+  {
+    av_write_trailer(o.fmt_ctx);
+  }
+
+  std::cout << "Drained in " << (monotonic_time_us() - drain_started_us) / 1000 << " ms: " << video_frames - frames_before_drain
+            << " frames in flight encoded, " << flushed_packets << " packets flushed from the encoder" << std::endl;
+
+  int64_t elapsed_us = monotonic_time_us() - epoch_us;
+  if (elapsed_us > 0)
+  {
+    std::cout << "Average video bitrate " << video_bytes * 8000 / elapsed_us << " kb/s";
+    if (opts.crf > 0)
+    {
+      std::cout << " at crf " << opts.crf;
+    }
+    std::cout << std::endl;
+  }
+  if (quality && quality->compared())
+  {
+    // at the same crf, compare the region psnr of runs with and without --roi-quality 0
+    std::cout << "Luma PSNR over " << quality->compared() << " frames: " << quality->roi_psnr()
+              << " dB in the regions of interest, " << quality->background_psnr() << " dB elsewhere" << std::endl;
+  }
+  if (quality && quality->average_qp() >= 0)
+  {
+    // at a fixed bitrate, whatever saves bits shows up as a lower quantizer
+    std::cout << "Average quantizer " << quality->average_qp() << std::endl;
+  }
+  if (opts.low_latency || !opts.mosaic.empty() || !opts.shm.empty())
+  {
+    std::cout << "Skipped " << source_skipped << " stale frames" << std::endl;
+  }
+  if (camera_reopens || slate_frames)
+  {
+    std::cout << "Reopened the stalled camera " << camera_reopens << " times, sent " << slate_frames << " slate frames" << std::endl;
+  }
+  if (processing)
+  {
+    std::cout << "Processed " << processing->processed() << " frames, " << processing->missed() << " passed through after missing the deadline" << std::endl;
+  }
+  if (motion)
+  {
+    std::cout << "Skipped " << motion->skipped() << " static frames" << std::endl;
+  }
+  if (denoiser)
+  {
+    std::cout << "Denoised " << denoiser->filtered() << " frames at " << denoiser->average_cost_us() << " us each, " << denoiser->over_budget()
+              << " over budget" << std::endl;
+  }
+  for (pipeline_stage stage : {pipeline_stage::source, pipeline_stage::encoder, pipeline_stage::output})
+  {
+    const recovery_stats &r = recoveries[static_cast<int>(stage)];
+    if (r.count)
+    {
+      std::cout << "Recovered the " << stage_name(stage) << " " << r.count << " times, " << r.total_us / static_cast<int64_t>(r.count) / 1000
+                << " ms on average, " << r.worst_us / 1000 << " ms at worst" << std::endl;
+    }
+  }
+  if (opts.cfr)
+  {
+    std::cout << "Constant frame rate: dropped " << clock.dropped() << ", duplicated " << clock.duplicated() << " frames" << std::endl;
+  }
+
+  sws_freeContext(swsctx);
+  free_frame_buffer(frame);
+  av_frame_free(&filtered);
+  graph.reset();
+  avcodec_close(out_codec_ctx);
+  for (output &o : outputs.outputs)
+  {
+    close_output(o, false);
+  }
+}
+
+void send_video(const stream_options &opts)
+{
+  double width = opts.width, height = opts.height;
+  double capture_width = opts.capture_width > 0 ? opts.capture_width : width;
+  double capture_height = opts.capture_height > 0 ? opts.capture_height : height;
+  cv::Rect crop;
+  if (!parse_crop(opts.crop, crop))
+  {
+    exit(1);
+  }
+  bool jpeg = opts.send_format == "jpeg";
+  if (!jpeg && opts.send_format != "i420")
+  {
+    std::cout << "Unknown frame format " << opts.send_format << ", use i420 or jpeg!" << std::endl;
+    exit(1);
+  }
+  if (jpeg && opts.yuyv)
+  {
+    std::cout << "JPEG frames are compressed from BGR and cannot be combined with yuyv capture!" << std::endl;
+    exit(1);
+  }
+
+  // the worker encodes at the size the frames arrive in, so raw frames are scaled here where the
+  // capture is still at hand. jpeg goes out as captured and is scaled on the worker
+  AVFrame *frame = nullptr;
+  if (!jpeg)
+  {
+    frame = av_frame_alloc();
+    frame->width = static_cast<int>(width) & ~1;
+    frame->height = static_cast<int>(height) & ~1;
+    frame->format = AV_PIX_FMT_YUV420P;
+    if (av_frame_get_buffer(frame, 0) < 0)
+    {
+      throw stage_error(pipeline_stage::encoder, "Could not allocate frame buffer!");
+    }
+  }
+  SwsContext *swsctx = nullptr;
+
+  auto open_source = [&]() -> frame_source * {
+    auto open_camera = [&]() -> frame_source * { return open_camera_source(opts, capture_width, capture_height); };
+    if (opts.watchdog > 0 && opts.shm.empty() && opts.listen.empty())
+    {
+      return new watchdog_source(open_camera, opts.watchdog * 1000LL);
+    }
+    return open_camera();
+  };
+
+  frame_sender sender(opts.send);
+  std::unique_ptr<frame_source> source;
+  cv::Mat image;
+  int64_t read_failing_since_us = 0;
+  int64_t backoff_ms = 100;
+  while (!stop_requested)
+  {
+    try
+    {
+      if (!source)
+      {
+        source.reset(open_source());
+        backoff_ms = 100;
+      }
+
+      int64_t timestamp_us;
+      if (!source->read(image, timestamp_us))
+      {
+        // the watchdog reopens the camera on its own, the worker fills in with its slate
+        if (dynamic_cast<watchdog_source *>(source.get()))
+        {
+          continue;
+        }
+        int64_t now = monotonic_time_us();
+        read_failing_since_us = read_failing_since_us ? read_failing_since_us : now;
+        if (now - read_failing_since_us > 1000000)
+        {
+          read_failing_since_us = 0;
+          throw stage_error(pipeline_stage::source, "Camera stopped delivering frames!");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        continue;
+      }
+      read_failing_since_us = 0;
+
+      if (jpeg)
+      {
+        sender.send_jpeg(crop.empty() ? image : image(crop & cv::Rect(0, 0, image.cols, image.rows)), opts.send_quality, timestamp_us);
+        continue;
+      }
+      swsctx = convert_image(swsctx, image, opts.yuyv, capture_width, capture_height, crop, frame);
+      sender.send_i420(frame, timestamp_us);
+    }
+    catch (const stage_error &e)
+    {
+      std::cout << e.what() << " Restarting the " << stage_name(e.stage) << std::endl;
+      source.reset();
+      for (int64_t slept = 0; slept < backoff_ms && !stop_requested; slept += 10)
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      backoff_ms = std::min<int64_t>(backoff_ms * 2, 5000);
+    }
+  }
+
+  std::cout << "Sent " << sender.sent() << " frames to the encode worker, dropped " << sender.dropped() << std::endl;
+  sws_freeContext(swsctx);
+  av_frame_free(&frame);
+}
+
+int main(int argc, char *argv[])
+{
+  stream_options opts;
+  std::vector<int> cameras;
+  std::vector<std::string> outputs;
+  bool mosaic = false;
+  std::string control;
+  bool dump_log = false;
+  bool processes = false;
+  std::string cpus;
+  std::string affinity = "none";
+  std::string stage_cpus;
+  std::string stats;
+
+  auto cli = ((option("-c", "--camera") & values("camera", cameras)) % "camera IDs, one pipeline each (default: 0)",
+              (option("-o", "--output") & values("output", outputs)) % "output RTMP servers, one per camera or a template with %d (default: rtmp://localhost/live/stream)",
+              (option("--mosaic") & value("mosaic", mosaic)) % "tile all cameras into a grid on a single output (default: false)",
+              (option("-f", "--fps") & value("fps", opts.fps)) % "frames-per-second (default: 30)",
+              (option("-w", "--width") & value("width", opts.width)) % "video width (default: 800)",
+              (option("-h", "--height") & value("height", opts.height)) % "video height (default: 640)",
+              (option("-b", "--bitrate") & value("bitrate", opts.bitrate)) % "stream bitrate in kb/s (default: 300000)",
+              (option("--crf") & value("crf", opts.crf)) % "constant quality 1-51 instead of the bitrate, 0 is off (default: 0)",
+              (option("--quality-stats") & value("quality-stats", opts.quality_stats)) %
+                  "print the luma PSNR inside and outside the regions of interest and the average quantizer on exit (default: false)",
+              (option("-p", "--profile") & value("profile", opts.profile)) % "H264 codec profile (baseline | high | high10 | high422 | high444 | main) (default: high444)",
+              (option("-l", "--log") & value("log", dump_log)) % "print debug output (default: false)",
+              (option("--low-latency") & value("low-latency", opts.low_latency)) % "always encode the newest captured frame, dropping stale ones (default: false)",
+              (option("--timestamps") & value("timestamps", opts.timestamps)) % "frame timestamps from (frames | wallclock | capture) (default: wallclock)",
+              (option("--cfr") & value("cfr", opts.cfr)) % "resample to a constant frame rate by dropping and duplicating frames (default: false)",
+              (option("-a", "--audio") & value("audio", opts.audio)) % "audio input (none | tone | alsa:<device> | pulse:<device> | file:<path>) (default: none)",
+              (option("--audio-bitrate") & value("audio-bitrate", opts.audio_bitrate)) % "AAC bitrate in b/s (default: 128000)",
+              (option("--audio-rate") & value("audio-rate", opts.audio_rate)) % "audio sample rate in Hz, the input is resampled to it (default: 44100)",
+              (option("--audio-channels") & value("audio-channels", opts.audio_channels)) % "audio channels, the input is remixed to them (default: 2)",
+              (option("--clock") & value("clock", opts.timestamp_overlay)) % "burn the local time into the video (default: false)",
+              (option("--text") & value("text", opts.text_overlay)) % "burn a line of text into the video",
+              (option("--logo") & value("logo", opts.logo_overlay)) % "burn an image, with alpha, into the top right corner",
+              (option("--process") & value("process", opts.processor)) % "per-frame processing (blur | gray | edges | <plugin.so>[:args])",
+              (option("--process-threads") & value("process-threads", opts.processing_threads)) % "frames in flight for processing (default: 2)",
+              (option("--process-budget") & value("process-budget", opts.processing_budget)) % "per-frame processing deadline in ms (default: one frame interval)",
+              (option("--idle-fps") & value("idle-fps", opts.idle_fps)) % "frame rate while the scene is static, 0 encodes every frame (default: 0)",
+              (option("--motion-threshold") & value("motion-threshold", opts.motion_threshold)) % "mean luma difference that counts a 16x16 block as moving (default: 6)",
+              (option("--roi") & value("roi", opts.roi)) % "regions of interest as x,y,w,h[,quality] separated by ';'",
+              (option("--roi-motion") & value("roi-motion", opts.roi_motion)) % "favour moving blocks when encoding (default: false)",
+              (option("--roi-quality") & value("roi-quality", opts.roi_quality)) % "quality offset for regions of interest, -1 best to 1 worst (default: -0.3)",
+              (option("--roi-background") & value("roi-background", opts.roi_background)) % "quality offset for everything outside the regions (default: 0)",
+              (option("--denoise") & value("denoise", opts.denoise)) % "temporal denoise strength 1-10, 0 disables (default: 0)",
+              (option("--denoise-threads") & value("denoise-threads", opts.denoise_threads)) % "denoise slices run in parallel (default: 2)",
+              (option("--denoise-budget") & value("denoise-budget", opts.denoise_budget)) % "per-frame denoise budget in ms (default: a quarter of the frame interval)",
+              (option("--vf") & value("vf", opts.vf)) % "libavfilter graph applied before encoding, e.g. crop=640:360,hqdn3d",
+              (option("--vf-threads") & value("vf-threads", opts.vf_threads)) % "filter graph threads, 0 for one per core (default: 0)",
+              (option("--capture-width") & value("capture-width", opts.capture_width)) % "camera capture width (default: video width)",
+              (option("--capture-height") & value("capture-height", opts.capture_height)) % "camera capture height (default: video height)",
+              (option("--crop") & value("crop", opts.crop)) % "crop x,y,w,h of the captured image before scaling",
+              (option("--control") & value("control", control)) % "control API on a unix socket path or an http [host:]port",
+              (option("--shutdown-timeout") & value("shutdown-timeout", opts.shutdown_timeout)) % "how long draining may block on the outputs at exit, in ms (default: 3000)",
+              (option("--watchdog") & value("watchdog", opts.watchdog)) % "reopen a camera silent for this long, in ms, sending a slate meanwhile, 0 to disable (default: 2000)",
+              (option("--dvr") & value("dvr", opts.dvr)) % "seconds of encoded packets kept for clip export, 0 to disable (default: 0)",
+              (option("--dvr-file") & value("dvr-file", opts.dvr_file)) % "keep the dvr packets in this memory mapped file instead of in memory",
+              (option("--spool") & value("spool", opts.spool)) % "spool packets to this file and upload what an outage of the first output missed",
+              (option("--spool-size") & value("spool-size", opts.spool_size)) % "spool file size in MB (default: 256)",
+              (option("--catch-up-rate") & value("catch-up-rate", opts.catch_up_rate)) % "spooled packets go out at this multiple of real time, 0 as fast as possible (default: 2)",
+              (option("--backfill") & value("backfill", opts.backfill)) % "send spooled packets to this output instead of in front of the live stream",
+              (option("--shm") & value("shm", opts.shm)) % "read frames from this POSIX shared memory segment instead of the camera",
+              (option("--shm-out") & value("shm-out", opts.shm_out)) % "also publish the encoded packets to local readers in this POSIX shared memory segment",
+              (option("--shm-out-size") & value("shm-out-size", opts.shm_out_size)) % "packet ring size in MB (default: 16)",
+              (option("--listen") & value("listen", opts.listen)) % "encode frames from a capture node connecting to this [host:]port instead of the camera",
+              (option("--send") & value("send", opts.send)) % "capture only and send the frames to the encode worker at this host:port",
+              (option("--send-format") & value("send-format", opts.send_format)) % "frames sent to the worker as (i420 | jpeg) (default: i420)",
+              (option("--send-quality") & value("send-quality", opts.send_quality)) % "JPEG quality of sent frames (default: 90)",
+              (option("--processes") & value("processes", processes)) % "run every camera in a worker process of its own under a supervisor (default: false)",
+              (option("--cpus") & value("cpus", cpus)) % "CPU sets of the pipelines as lists like 0-3,8 separated by ';' (default: planned from the CPU topology)",
+              (option("--affinity") & value("affinity", affinity)) % "place pipelines and their stages by the CPU topology (none | auto) (default: none)",
+              (option("--stage-cpus") & value("stage-cpus", stage_cpus)) % "stage placement like capture=0;convert=0;encode=0-3;network=3, positions within the pipeline's CPUs",
+              (option("--stats") & value("stats", stats)) % "POSIX shared memory segment the worker processes publish their counters in",
+              (option("--yuyv") & value("yuyv", opts.yuyv)) % "take raw yuyv frames from the camera and convert them while scaling (default: false)");
+
+  if (!parse(argc, argv, cli))
+  {
+    std::cout << make_man_page(cli, argv[0]) << std::endl;
+    return 1;
+  }
+
+  if (dump_log)
+  {
+    av_log_set_level(AV_LOG_DEBUG);
+  }
+
+  if (cameras.empty())
+  {
+    cameras.push_back(opts.camera);
+  }
+  if (outputs.empty())
+  {
+    outputs.push_back(opts.output);
+  }
+  if (opts.audio_rate < 8000 || opts.audio_rate > 96000 || opts.audio_channels < 1 || opts.audio_channels > 8)
+  {
+    std::cout << "The audio rate goes from 8000 to 96000 Hz and the channels from 1 to 8!" << std::endl;
+    return 1;
+  }
+  if (mosaic && outputs.size() != 1)
+  {
+    std::cout << "The mosaic is a single stream, give it a single output!" << std::endl;
+    return 1;
+  }
+  if (outputs.size() != 1 && outputs.size() != cameras.size())
+  {
+    std::cout << "Give one output per camera or a single output template!" << std::endl;
+    return 1;
+  }
+
+  avdevice_register_all();
+
+  std::signal(SIGINT, handle_stop_signal);
+  std::signal(SIGTERM, handle_stop_signal);
+
+  if ((!opts.send.empty() || !opts.listen.empty()) && (mosaic || cameras.size() != 1))
+  {
+    std::cout << "Frames go over the network for a single camera, run one capture node and worker per camera!" << std::endl;
+    return 1;
+  }
+
+  // file and segment names are templates like the outputs
+  auto camera_options = [&](size_t i) {
+    stream_options pipeline_opts = opts;
+    pipeline_opts.camera = cameras[i];
+    pipeline_opts.cameras = processes ? 1 : cameras.size();
+    pipeline_opts.output = pipeline_output(outputs, i, cameras[i], cameras.size());
+    if (!opts.dvr_file.empty())
+    {
+      pipeline_opts.dvr_file = pipeline_output({opts.dvr_file}, 0, cameras[i], cameras.size());
+    }
+    if (!opts.shm.empty())
+    {
+      pipeline_opts.shm = pipeline_output({opts.shm}, 0, cameras[i], cameras.size());
+    }
+    if (!opts.shm_out.empty())
+    {
+      pipeline_opts.shm_out = pipeline_output({opts.shm_out}, 0, cameras[i], cameras.size());
+    }
+    if (!opts.spool.empty())
+    {
+      pipeline_opts.spool = pipeline_output({opts.spool}, 0, cameras[i], cameras.size());
+    }
+    if (!opts.backfill.empty())
+    {
+      pipeline_opts.backfill = pipeline_output({opts.backfill}, 0, cameras[i], cameras.size());
+    }
+    return pipeline_opts;
+  };
+
+  if (affinity != "none" && affinity != "auto")
+  {
+    std::cout << "Unknown affinity " << affinity << ", use none or auto!" << std::endl;
+    return 1;
+  }
+
+  // pipelines are pinned with --cpus or when planned from the topology, worker processes included.
+  // their stages share the pipeline's CPUs unless planned as well
+  size_t pipeline_count = mosaic ? 1 : cameras.size();
+  std::vector<cpu_info> topology = read_cpu_topology();
+  std::vector<std::vector<int>> cpu_sets;
+  if (!cpus.empty())
+  {
+    std::stringstream sets(cpus);
+    std::string set;
+    while (std::getline(sets, set, ';'))
+    {
+      cpu_sets.emplace_back();
+      if (!parse_cpu_list(set, cpu_sets.back()))
+      {
+        std::cout << "Invalid CPU list " << set << "!" << std::endl;
+        return 1;
+      }
+    }
+    if (cpu_sets.size() != pipeline_count)
+    {
+      std::cout << "Give one CPU set per pipeline!" << std::endl;
+      return 1;
+    }
+  }
+  else if (affinity == "auto" || !stage_cpus.empty())
+  {
+    cpu_sets = plan_pipeline_cpus(topology, pipeline_count);
+  }
+  std::vector<pipeline_affinity> placements(pipeline_count);
+  for (size_t i = 0; i < cpu_sets.size(); i++)
+  {
+    if (affinity == "auto" || !stage_cpus.empty())
+    {
+      if (!plan_stages(topology, cpu_sets[i], stage_cpus, placements[i]))
+      {
+        std::cout << "Invalid stage CPUs " << stage_cpus << "!" << std::endl;
+        return 1;
+      }
+    }
+    else
+    {
+      placements[i] = {cpu_sets[i], cpu_sets[i], cpu_sets[i], cpu_sets[i], cpu_sets[i]};
+    }
+  }
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  // without a plan the encoders split the cores, with one they are confined to their pipeline's CPUs
+  auto place = [&](stream_options &pipeline_opts, size_t i) {
+    pipeline_opts.affinity = placements[i];
+    if (!placements[i].encode.empty())
+    {
+      pipeline_opts.encoder_threads = placements[i].encode.size();
+    }
+    else if (pipeline_count > 1)
+    {
+      pipeline_opts.encoder_threads = std::max(1, cores / static_cast<int>(pipeline_count));
+    }
+    if (pipeline_opts.vf_threads == 0 && pipeline_opts.encoder_threads > 0)
+    {
+      pipeline_opts.vf_threads = pipeline_opts.encoder_threads;
+    }
+  };
+
+  if (processes)
+  {
+    if (mosaic || !opts.send.empty() || !control.empty())
+    {
+      std::cout << "Worker processes run one camera each and cannot be combined with the mosaic, sending or the control API!" << std::endl;
+      return 1;
+    }
+
+    stats_segment segment(stats, cameras.size());
+    for (size_t i = 0; i < cameras.size(); i++)
+    {
+      segment.slot(i)->camera.store(cameras[i], std::memory_order_relaxed);
+    }
+    supervisor workers(
+        [&](size_t i) {
+          stream_options worker_opts = camera_options(i);
+          worker_opts.stats = segment.slot(i);
+          place(worker_opts, i);
+          try
+          {
+            stream_video(worker_opts);
+          }
+          catch (const std::exception &e)
+          {
+            std::cout << "Camera " << worker_opts.camera << " stopped: " << e.what() << std::endl;
+            return 1;
+          }
+          return 0;
+        },
+        cpu_sets, segment, opts.shutdown_timeout);
+    workers.run(stop_requested);
+    return 0;
+  }
+
+  std::unique_ptr<control_server> control_api;
+  if (!control.empty())
+  {
+    control_api.reset(new control_server(control));
+    opts.control = control_api.get();
+  }
+
+  if (!opts.send.empty())
+  {
+    opts.camera = cameras[0];
+    try
+    {
+      send_video(opts);
+    }
+    catch (const std::exception &e)
+    {
+      std::cout << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  if (mosaic || cameras.size() == 1)
+  {
+    if (mosaic)
+    {
+      opts.mosaic = cameras;
+      opts.output = outputs[0];
+    }
+    else
+    {
+      opts.camera = cameras[0];
+      opts.output = pipeline_output(outputs, 0, cameras[0], 1);
+    }
+    place(opts, 0);
+
+    // whatever the supervisor could not recover from, typically a failure while starting up
+    try
+    {
+      stream_video(opts);
+    }
+    catch (const std::exception &e)
+    {
+      std::cout << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  // one pool sized to the machine instead of a set of threads per camera
+  work_stealing_pool pool;
+  std::vector<std::thread> pipelines;
+  for (size_t i = 0; i < cameras.size(); i++)
+  {
+    stream_options pipeline_opts = camera_options(i);
+    pipeline_opts.pool = &pool;
+    pipeline_opts.pipeline = i;
+    place(pipeline_opts, i);
+
+    pipelines.emplace_back([pipeline_opts] {
+      // a camera that fails takes only its own pipeline down
+      try
+      {
+        stream_video(pipeline_opts);
+      }
+      catch (const std::exception &e)
+      {
+        std::cout << "Camera " << pipeline_opts.camera << " stopped: " << e.what() << std::endl;
+      }
+    });
+  }
+
+  for (std::thread &t : pipelines)
+  {
+    t.join();
+  }
 
   return 0;
 }
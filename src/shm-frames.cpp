@@ -0,0 +1,228 @@
+#include "shm-frames.h"
+#include "frame-clock.h"
+#include "stage-error.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const uint32_t shm_frame_magic = 0x4d524653;
+static const uint32_t shm_frame_version = 1;
+static const size_t slot_header_size = 64;
+
+// shared between processes, so no FUTEX_PRIVATE_FLAG
+void shm_futex_wait(std::atomic<uint32_t> *word, uint32_t value, int64_t timeout_us)
+{
+  timespec timeout = {static_cast<time_t>(timeout_us / 1000000), static_cast<long>(timeout_us % 1000000 * 1000)};
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, value, &timeout, nullptr, 0);
+}
+
+void shm_futex_wake(std::atomic<uint32_t> *word, int waiters)
+{
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, waiters, nullptr, nullptr, 0);
+}
+
+static shm_frame_slot *slot_at(uint8_t *base, const shm_frame_header *header, uint32_t slot)
+{
+  return reinterpret_cast<shm_frame_slot *>(base + slot_header_size + static_cast<size_t>(slot) * header->slot_size);
+}
+
+shm_frame_writer::shm_frame_writer(const std::string &name, int width, int height, shm_frame_format format, int slots)
+    : name(name), size(0), base(nullptr), header(nullptr), frames(0)
+{
+  static_assert(sizeof(shm_frame_header) <= slot_header_size, "the header has to fit in front of the first slot");
+
+  size_t stride = static_cast<size_t>(width) * (format == shm_bgr24 ? 3 : 2);
+  size_t slot_size = (slot_header_size + stride * height + 63) & ~static_cast<size_t>(63);
+  size = slot_header_size + slot_size * slots;
+
+  // a segment left behind by an earlier producer may have another layout
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  void *mapped = MAP_FAILED;
+  if (fd >= 0 && ftruncate(fd, size) == 0)
+  {
+    mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+  if (mapped == MAP_FAILED)
+  {
+    throw stage_error(pipeline_stage::source, "Could not create shared memory " + name + "!");
+  }
+
+  base = static_cast<uint8_t *>(mapped);
+  header = reinterpret_cast<shm_frame_header *>(base);
+  header->version = shm_frame_version;
+  header->width = width;
+  header->height = height;
+  header->format = format;
+  header->stride = stride;
+  header->slots = slots;
+  header->slot_size = slot_size;
+  header->reader_slot = -1;
+  // readers only look at a segment once the magic is there
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = shm_frame_magic;
+}
+
+shm_frame_writer::~shm_frame_writer()
+{
+  munmap(base, size);
+  shm_unlink(name.c_str());
+}
+
+void shm_frame_writer::publish(const uint8_t *pixels, size_t stride, int64_t timestamp_us)
+{
+  // the slot after the newest one that the reader does not hold. marking it as being written and then
+  // looking at the reader again pairs with the reader announcing its slot and then checking it, so one
+  // of the two always backs off
+  uint32_t slot = header->latest_slot;
+  shm_frame_slot *s = nullptr;
+  uint64_t previous = 0;
+  for (uint32_t tries = 0; tries < header->slots * 2; tries++)
+  {
+    slot = (slot + 1) % header->slots;
+    if (static_cast<int32_t>(slot) == header->reader_slot)
+    {
+      continue;
+    }
+    s = slot_at(base, header, slot);
+    previous = s->sequence;
+    s->sequence = frames * 2 + 1;
+    if (static_cast<int32_t>(slot) != header->reader_slot)
+    {
+      // the slot is marked as being written before any of its pixels change, also on weakly
+      // ordered cpus
+      std::atomic_thread_fence(std::memory_order_release);
+      break;
+    }
+    s->sequence = previous;
+    s = nullptr;
+  }
+  if (!s)
+  {
+    return;
+  }
+
+  uint8_t *dst = reinterpret_cast<uint8_t *>(s) + slot_header_size;
+  size_t row = std::min<size_t>(stride, header->stride);
+  for (uint32_t y = 0; y < header->height; y++)
+  {
+    memcpy(dst + y * header->stride, pixels + y * stride, row);
+  }
+  s->timestamp_us = timestamp_us;
+  s->sequence.store(frames * 2 + 2, std::memory_order_release);
+
+  // the pixels and the sequence are visible to whoever sees the new slot
+  header->latest_slot.store(slot, std::memory_order_release);
+  header->published.store(++frames, std::memory_order_release);
+  header->futex++;
+  if (header->reader_waiting)
+  {
+    shm_futex_wake(&header->futex, 1);
+  }
+}
+
+shm_frame_source::shm_frame_source(const std::string &name, bool yuyv)
+    : size(0), base(nullptr), header(nullptr), width(0), height(0), type(yuyv ? CV_8UC2 : CV_8UC3), stride(0), slots(0), slot_size(0), last_frame(0), skipped_frames(0)
+{
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  struct stat st;
+  void *mapped = MAP_FAILED;
+  if (fd >= 0 && fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= slot_header_size)
+  {
+    size = st.st_size;
+    mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+  if (mapped == MAP_FAILED)
+  {
+    throw stage_error(pipeline_stage::source, "Could not open shared memory " + name + "!");
+  }
+
+  base = static_cast<uint8_t *>(mapped);
+  header = reinterpret_cast<shm_frame_header *>(base);
+  width = header->width;
+  height = header->height;
+  stride = header->stride;
+  slots = header->slots;
+  slot_size = header->slot_size;
+  // every frame has to fit its slot and every slot the segment, whatever the producer claims
+  size_t bytes_per_pixel = yuyv ? 2 : 3;
+  bool valid = header->magic == shm_frame_magic && header->version == shm_frame_version && slots > 0 && slots <= size / slot_header_size &&
+               width > 0 && height > 0 && width <= 65536 && height <= 65536 && stride >= width * bytes_per_pixel &&
+               slot_header_size + stride * height <= slot_size && slot_size <= size / slots && slot_header_size + slot_size * slots <= size;
+  if (!valid || header->format != static_cast<uint32_t>(yuyv ? shm_yuyv422 : shm_bgr24))
+  {
+    munmap(base, size);
+    throw stage_error(pipeline_stage::source, "Shared memory " + name + " does not hold " + (yuyv ? "yuyv" : "bgr") + " frames!");
+  }
+
+  // start with whatever comes next, not with a frame that may be long stale
+  last_frame = header->published;
+}
+
+shm_frame_source::~shm_frame_source()
+{
+  header->reader_slot = -1;
+  munmap(base, size);
+}
+
+bool shm_frame_source::read(cv::Mat &image, int64_t &timestamp_us)
+{
+  // the frame handed out last time is done with
+  header->reader_slot = -1;
+
+  // short, so the pipeline keeps serving control requests while the producer is quiet
+  int64_t deadline_us = monotonic_time_us() + 100000;
+  while (header->published.load(std::memory_order_acquire) == last_frame)
+  {
+    int64_t left_us = deadline_us - monotonic_time_us();
+    if (left_us <= 0)
+    {
+      return false;
+    }
+    uint32_t word = header->futex;
+    header->reader_waiting = 1;
+    if (header->published == last_frame)
+    {
+      shm_futex_wait(&header->futex, word, left_us);
+    }
+    header->reader_waiting = 0;
+  }
+
+  // take the newest frame, unless the producer started overwriting it before we could claim it
+  while (true)
+  {
+    uint32_t slot = header->latest_slot.load(std::memory_order_acquire);
+    if (slot >= slots)
+    {
+      return false;
+    }
+    shm_frame_slot *s = reinterpret_cast<shm_frame_slot *>(base + slot_header_size + slot * slot_size);
+    uint64_t sequence = s->sequence.load(std::memory_order_acquire);
+    header->reader_slot = static_cast<int32_t>(slot);
+    if (sequence % 2 == 0 && sequence > 0 && s->sequence == sequence)
+    {
+      uint64_t frame = sequence / 2;
+      skipped_frames += frame - last_frame - 1;
+      last_frame = frame;
+      timestamp_us = s->timestamp_us;
+      image = cv::Mat(height, width, type, reinterpret_cast<uint8_t *>(s) + slot_header_size, stride);
+      return true;
+    }
+    header->reader_slot = -1;
+  }
+}
@@ -0,0 +1,103 @@
+#ifndef SHM_FRAMES_H
+#define SHM_FRAMES_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "capture.h"
+
+// sleep on and wake a word in a segment shared with other processes
+void shm_futex_wait(std::atomic<uint32_t> *word, uint32_t value, int64_t timeout_us);
+void shm_futex_wake(std::atomic<uint32_t> *word, int waiters);
+
+// raw frames handed over by another process through a POSIX shared memory segment. the producer owns
+// the segment and writes frames into a ring of slots, the reader maps it and reads the newest frame in
+// place. the only thing the reader writes is the slot it holds, which the producer then leaves alone.
+// all fields are little endian and naturally aligned, so producers need not be written in C++
+enum shm_frame_format : uint32_t
+{
+  shm_bgr24 = 0x33524742,
+  shm_yuyv422 = 0x56595559
+};
+
+struct shm_frame_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t format;
+  uint32_t stride;
+  uint32_t slots;
+  // bytes from one slot to the next, the slot header included, a multiple of 64
+  uint32_t slot_size;
+  // frames published so far
+  std::atomic<uint64_t> published;
+  // slot of the newest frame
+  std::atomic<uint32_t> latest_slot;
+  // bumped with every frame, a reader sleeps on it with FUTEX_WAIT
+  std::atomic<uint32_t> futex;
+  // set while a reader sleeps, the producer only calls FUTEX_WAKE then
+  std::atomic<uint32_t> reader_waiting;
+  // slot the reader holds, -1 for none
+  std::atomic<int32_t> reader_slot;
+};
+
+// in front of every slot's pixels, which start 64 bytes into the slot. sequence is odd while the
+// producer writes the slot and twice the frame number plus two once the frame is complete
+struct shm_frame_slot
+{
+  std::atomic<uint64_t> sequence;
+  int64_t timestamp_us;
+};
+
+// the producing side, for processes that link this file
+class shm_frame_writer
+{
+public:
+  shm_frame_writer(const std::string &name, int width, int height, shm_frame_format format, int slots = 4);
+  ~shm_frame_writer();
+
+  // copies one frame into the next free slot and wakes the reader, never waits for it
+  void publish(const uint8_t *pixels, size_t stride, int64_t timestamp_us);
+
+private:
+  std::string name;
+  size_t size;
+  uint8_t *base;
+  shm_frame_header *header;
+  uint64_t frames;
+};
+
+// a frame source reading from a segment published by shm_frame_writer or anything compatible. frames
+// are handed out without a copy and stay valid until the next read
+class shm_frame_source : public frame_source
+{
+public:
+  shm_frame_source(const std::string &name, bool yuyv);
+  ~shm_frame_source();
+
+  bool read(cv::Mat &image, int64_t &timestamp_us) override;
+  // the producer decides size and rate
+  void set_size(double width, double height) override {}
+  void set_fps(double fps) override {}
+  uint64_t skipped() const override { return skipped_frames; }
+
+private:
+  size_t size;
+  uint8_t *base;
+  shm_frame_header *header;
+  // the layout as checked when opening, the producer cannot change it under the reader
+  int width;
+  int height;
+  int type;
+  size_t stride;
+  uint32_t slots;
+  size_t slot_size;
+  uint64_t last_frame;
+  uint64_t skipped_frames;
+};
+
+#endif
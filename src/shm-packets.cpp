@@ -0,0 +1,274 @@
+#include "shm-packets.h"
+#include "frame-clock.h"
+#include "shm-frames.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const uint32_t shm_packet_magic = 0x4b505253;
+static const uint32_t shm_packet_version = 1;
+static const uint64_t no_keyframe = UINT64_MAX;
+
+static size_t ring_offset()
+{
+  return (sizeof(shm_packet_header) + 4095) & ~static_cast<size_t>(4095);
+}
+
+static uint64_t record_length(int64_t payload)
+{
+  return (sizeof(shm_packet_record) + payload + 63) & ~static_cast<uint64_t>(63);
+}
+
+shm_packet_publisher::shm_packet_publisher(const std::string &name, size_t capacity)
+    : name(name), size(0), base(nullptr), header(nullptr), ring(nullptr), packets(0)
+{
+  capacity &= ~static_cast<size_t>(63);
+  size = ring_offset() + capacity;
+
+  // a segment left behind by an earlier run may have another size
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  void *mapped = MAP_FAILED;
+  if (fd >= 0 && ftruncate(fd, size) == 0)
+  {
+    mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+  if (mapped == MAP_FAILED)
+  {
+    std::cout << "Could not create shared memory " << name << "!" << std::endl;
+    exit(1);
+  }
+
+  base = static_cast<uint8_t *>(mapped);
+  ring = base + ring_offset();
+  header = reinterpret_cast<shm_packet_header *>(base);
+  header->version = shm_packet_version;
+  header->capacity = capacity;
+  header->keyframe = no_keyframe;
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = shm_packet_magic;
+}
+
+shm_packet_publisher::~shm_packet_publisher()
+{
+  munmap(base, size);
+  shm_unlink(name.c_str());
+}
+
+void shm_packet_publisher::set_stream(int stream_index, const AVCodecContext *codec_ctx)
+{
+  if (stream_index >= shm_packet_max_streams)
+  {
+    return;
+  }
+
+  header->params_sequence.fetch_add(1, std::memory_order_relaxed);
+  // odd before any parameter changes
+  std::atomic_thread_fence(std::memory_order_release);
+  shm_packet_stream &s = header->stream[stream_index];
+  s.codec_id = codec_ctx->codec_id;
+  s.media_type = codec_ctx->codec_type;
+  s.width = codec_ctx->width;
+  s.height = codec_ctx->height;
+  s.sample_rate = codec_ctx->sample_rate;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+  s.channels = codec_ctx->ch_layout.nb_channels;
+#else
+  s.channels = codec_ctx->channels;
+#endif
+  s.time_base_num = codec_ctx->time_base.num;
+  s.time_base_den = codec_ctx->time_base.den;
+  s.extradata_size = std::min(codec_ctx->extradata_size, shm_packet_max_extradata);
+  if (s.extradata_size)
+  {
+    memcpy(s.extradata, codec_ctx->extradata, s.extradata_size);
+  }
+  header->streams = std::max<uint32_t>(header->streams, stream_index + 1);
+  header->params_sequence.fetch_add(1, std::memory_order_release);
+}
+
+void shm_packet_publisher::publish(int stream_index, const AVPacket *pkt)
+{
+  uint64_t capacity = header->capacity;
+  uint64_t length = record_length(pkt->size);
+  if (pkt->size < 0 || length > capacity || stream_index >= shm_packet_max_streams)
+  {
+    return;
+  }
+
+  // readers check the tail after copying a record, so it moves ahead before its bytes are reused
+  uint64_t position = header->head.load(std::memory_order_relaxed);
+  uint64_t offset = position % capacity;
+  if (offset + length > capacity)
+  {
+    uint64_t padding = capacity - offset;
+    header->tail.store(std::max<uint64_t>(header->tail.load(std::memory_order_relaxed), position + padding > capacity ? position + padding - capacity : 0),
+                       std::memory_order_release);
+    shm_packet_record pad = {shm_packet_padding, static_cast<int32_t>(padding - sizeof(shm_packet_record)), -1, 0, 0, 0, 0, 0};
+    memcpy(ring + offset, &pad, sizeof(pad));
+    position += padding;
+    offset = 0;
+  }
+  if (position + length > capacity)
+  {
+    header->tail.store(std::max<uint64_t>(header->tail.load(std::memory_order_relaxed), position + length - capacity), std::memory_order_release);
+  }
+  // the tail moves before any of the bytes it gave up are overwritten, also on weakly ordered cpus
+  std::atomic_thread_fence(std::memory_order_release);
+
+  shm_packet_record record = {shm_packet_data, pkt->size, stream_index, pkt->flags, pkt->pts, pkt->dts, pkt->duration, packets++};
+  memcpy(ring + offset, &record, sizeof(record));
+  memcpy(ring + offset + sizeof(record), pkt->data, pkt->size);
+  header->head.store(position + length, std::memory_order_release);
+
+  if (header->stream[stream_index].media_type == AVMEDIA_TYPE_VIDEO && (pkt->flags & AV_PKT_FLAG_KEY))
+  {
+    header->keyframe.store(position, std::memory_order_release);
+  }
+
+  header->futex++;
+  if (header->readers_waiting)
+  {
+    shm_futex_wake(&header->futex, INT_MAX);
+  }
+}
+
+shm_packet_reader::shm_packet_reader(const std::string &name)
+    : size(0), base(nullptr), header(nullptr), ring(nullptr), position(0), next_seq(0), skipped_packets(0)
+{
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  struct stat st;
+  void *mapped = MAP_FAILED;
+  if (fd >= 0 && fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) > ring_offset())
+  {
+    size = st.st_size;
+    mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+  if (mapped == MAP_FAILED)
+  {
+    throw std::runtime_error("Could not open shared memory " + name + "!");
+  }
+
+  base = static_cast<uint8_t *>(mapped);
+  ring = base + ring_offset();
+  header = reinterpret_cast<shm_packet_header *>(base);
+  if (header->magic != shm_packet_magic || header->version != shm_packet_version || ring_offset() + header->capacity > size)
+  {
+    munmap(base, size);
+    throw std::runtime_error("Shared memory " + name + " holds no packets!");
+  }
+
+  // a decoder can start right away from the newest keyframe
+  uint64_t keyframe = header->keyframe.load(std::memory_order_acquire), tail = header->tail.load(std::memory_order_acquire);
+  uint64_t head = header->head.load(std::memory_order_acquire);
+  position = keyframe != no_keyframe && keyframe >= tail && keyframe < head ? keyframe : head;
+}
+
+shm_packet_reader::~shm_packet_reader()
+{
+  munmap(base, size);
+}
+
+bool shm_packet_reader::stream(int stream_index, shm_packet_stream &info)
+{
+  if (stream_index < 0 || stream_index >= shm_packet_max_streams)
+  {
+    return false;
+  }
+
+  uint64_t sequence;
+  do
+  {
+    sequence = header->params_sequence.load(std::memory_order_acquire);
+    memcpy(&info, &header->stream[stream_index], sizeof(info));
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while (sequence % 2 || header->params_sequence.load(std::memory_order_relaxed) != sequence);
+
+  return static_cast<uint32_t>(stream_index) < header->streams && info.time_base_den > 0;
+}
+
+bool shm_packet_reader::next(AVPacket *pkt, int &stream_index, int timeout_ms)
+{
+  uint64_t capacity = header->capacity;
+  int64_t deadline_us = monotonic_time_us() + timeout_ms * 1000LL;
+  while (true)
+  {
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    if (position >= head)
+    {
+      int64_t left_us = deadline_us - monotonic_time_us();
+      if (left_us <= 0)
+      {
+        return false;
+      }
+      uint32_t word = header->futex;
+      header->readers_waiting++;
+      if (header->head == head)
+      {
+        shm_futex_wait(&header->futex, word, left_us);
+      }
+      header->readers_waiting--;
+      continue;
+    }
+
+    shm_packet_record record;
+    uint64_t offset = position % capacity;
+    bool readable = position >= header->tail.load(std::memory_order_acquire);
+    if (readable)
+    {
+      memcpy(&record, ring + offset, sizeof(record));
+      readable = record.size >= 0 && offset + record_length(record.size) <= capacity;
+    }
+    if (readable && record.type == shm_packet_data && av_new_packet(pkt, record.size) >= 0)
+    {
+      memcpy(pkt->data, ring + offset + sizeof(record), record.size);
+    }
+
+    // the publisher gives bytes up before it overwrites them, a copy made while the tail was still
+    // behind us is intact
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!readable || header->tail.load(std::memory_order_relaxed) > position)
+    {
+      av_packet_unref(pkt);
+      // lapped, start over where a decoder can
+      uint64_t keyframe = header->keyframe.load(std::memory_order_acquire), tail = header->tail.load(std::memory_order_acquire);
+      head = header->head.load(std::memory_order_acquire);
+      position = keyframe != no_keyframe && keyframe >= tail && keyframe < head ? keyframe : head;
+      continue;
+    }
+
+    position += record_length(record.size);
+    if (record.type != shm_packet_data || !pkt->data)
+    {
+      continue;
+    }
+
+    pkt->flags = record.flags;
+    pkt->pts = record.pts;
+    pkt->dts = record.dts;
+    pkt->duration = record.duration;
+    stream_index = record.stream_index;
+    if (next_seq && record.seq > next_seq)
+    {
+      skipped_packets += record.seq - next_seq;
+    }
+    next_seq = record.seq + 1;
+    return true;
+  }
+}
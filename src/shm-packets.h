@@ -0,0 +1,125 @@
+#ifndef SHM_PACKETS_H
+#define SHM_PACKETS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+// encoded packets published to local processes through a POSIX shared memory segment, next to the
+// network outputs. packets go into a byte ring that the publisher overwrites without ever waiting for
+// a reader, readers that were lapped notice it and start over at the newest keyframe. all fields are
+// little endian and naturally aligned, positions count bytes since the segment was created
+static const int shm_packet_max_streams = 4;
+static const int shm_packet_max_extradata = 1024;
+
+struct shm_packet_stream
+{
+  uint32_t codec_id;
+  uint32_t media_type;
+  int32_t width;
+  int32_t height;
+  int32_t sample_rate;
+  int32_t channels;
+  int32_t time_base_num;
+  int32_t time_base_den;
+  uint32_t extradata_size;
+  uint8_t extradata[shm_packet_max_extradata];
+};
+
+struct shm_packet_header
+{
+  uint32_t magic;
+  uint32_t version;
+  // bytes in the ring, which starts at the first page after the header
+  uint64_t capacity;
+  // odd while the stream parameters are being rewritten, readers copy them until it is even and unchanged
+  std::atomic<uint64_t> params_sequence;
+  uint32_t streams;
+  shm_packet_stream stream[shm_packet_max_streams];
+  // end of the newest record
+  std::atomic<uint64_t> head;
+  // start of the oldest byte not yet given up, moved ahead before anything is overwritten
+  std::atomic<uint64_t> tail;
+  // start of the newest video keyframe
+  std::atomic<uint64_t> keyframe;
+  // bumped with every packet, readers sleep on it with FUTEX_WAIT
+  std::atomic<uint32_t> futex;
+  // readers sleeping right now, the publisher only calls FUTEX_WAKE while there are any
+  std::atomic<uint32_t> readers_waiting;
+};
+
+// records start on 64 byte boundaries, a record that would not fit before the end of the ring is
+// preceded by a padding record up to it
+enum shm_packet_record_type : uint32_t
+{
+  shm_packet_data = 1,
+  shm_packet_padding = 2
+};
+
+struct shm_packet_record
+{
+  uint32_t type;
+  int32_t size;
+  int32_t stream_index;
+  int32_t flags;
+  int64_t pts;
+  int64_t dts;
+  int64_t duration;
+  // counts packets, so a reader knows how many it lost when it was lapped
+  uint64_t seq;
+};
+
+class shm_packet_publisher
+{
+public:
+  shm_packet_publisher(const std::string &name, size_t capacity);
+  ~shm_packet_publisher();
+
+  // parameters readers need to decode or remux a stream, set again whenever an encoder is reopened
+  void set_stream(int stream_index, const AVCodecContext *codec_ctx);
+
+  // pkt is in the time base of the stream's encoder. never blocks
+  void publish(int stream_index, const AVPacket *pkt);
+
+private:
+  std::string name;
+  size_t size;
+  uint8_t *base;
+  shm_packet_header *header;
+  uint8_t *ring;
+  uint64_t packets;
+};
+
+// the reading side, for processes that link this file
+class shm_packet_reader
+{
+public:
+  explicit shm_packet_reader(const std::string &name);
+  ~shm_packet_reader();
+
+  // copies the stream parameters, false if the segment has none for stream_index
+  bool stream(int stream_index, shm_packet_stream &info);
+
+  // waits at most timeout_ms for the next packet, which is copied into pkt. pkt has to be unreferenced
+  bool next(AVPacket *pkt, int &stream_index, int timeout_ms);
+
+  // packets lost because the publisher lapped this reader
+  uint64_t skipped() const { return skipped_packets; }
+
+private:
+  size_t size;
+  uint8_t *base;
+  shm_packet_header *header;
+  uint8_t *ring;
+  uint64_t position;
+  uint64_t next_seq;
+  uint64_t skipped_packets;
+};
+
+#endif
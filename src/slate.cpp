@@ -0,0 +1,104 @@
+#include "slate.h"
+#include "stage-error.h"
+
+#include <cstring>
+
+#include <opencv2/imgproc.hpp>
+
+extern "C"
+{
+#include <libswscale/swscale.h>
+}
+
+slate::slate(AVCodecContext *encoder, const std::string &text) : frame_width(encoder->width), frame_height(encoder->height), position(0)
+{
+  cv::Mat image(frame_height, frame_width, CV_8UC3, cv::Scalar(40, 40, 40));
+  double scale = frame_height / 400.0;
+  int baseline = 0;
+  cv::Size size = cv::getTextSize(text, cv::FONT_HERSHEY_SIMPLEX, scale, 2, &baseline);
+  cv::putText(image, text, cv::Point((frame_width - size.width) / 2, (frame_height + size.height) / 2), cv::FONT_HERSHEY_SIMPLEX, scale,
+              cv::Scalar(200, 200, 200), 2, cv::LINE_AA);
+
+  AVFrame *frame = av_frame_alloc();
+  frame->width = frame_width;
+  frame->height = frame_height;
+  frame->format = static_cast<int>(encoder->pix_fmt);
+  SwsContext *swsctx = sws_getContext(frame_width, frame_height, AV_PIX_FMT_BGR24, frame_width, frame_height, encoder->pix_fmt, SWS_BICUBIC, nullptr,
+                                      nullptr, nullptr);
+  if (av_frame_get_buffer(frame, 0) < 0 || !swsctx)
+  {
+    av_frame_free(&frame);
+    sws_freeContext(swsctx);
+    throw stage_error(pipeline_stage::encoder, "Could not prepare the slate!");
+  }
+
+  const uint8_t *src[] = {image.data};
+  const int src_stride[] = {static_cast<int>(image.step[0])};
+  sws_scale(swsctx, src, src_stride, 0, frame_height, frame->data, frame->linesize);
+  sws_freeContext(swsctx);
+
+  // a still picture, everything after the keyframe is close to empty
+  int ret = 0;
+  for (int i = 0; i <= encoder->gop_size && ret >= 0; i++)
+  {
+    if (i < encoder->gop_size)
+    {
+      frame->pts = av_rescale_q(i, av_inv_q(encoder->framerate), encoder->time_base);
+      frame->pict_type = i == 0 ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+      ret = avcodec_send_frame(encoder, frame);
+    }
+    else
+    {
+      ret = avcodec_send_frame(encoder, nullptr);
+    }
+
+    while (ret >= 0)
+    {
+      AVPacket *pkt = av_packet_alloc();
+      if (avcodec_receive_packet(encoder, pkt) < 0)
+      {
+        av_packet_free(&pkt);
+        break;
+      }
+      packets.push_back(pkt);
+    }
+  }
+  av_frame_free(&frame);
+
+  if (ret < 0 || packets.empty() || !(packets[0]->flags & AV_PKT_FLAG_KEY))
+  {
+    throw stage_error(pipeline_stage::encoder, "Could not encode the slate!");
+  }
+  extradata.assign(encoder->extradata, encoder->extradata + encoder->extradata_size);
+}
+
+slate::~slate()
+{
+  for (AVPacket *pkt : packets)
+  {
+    av_packet_free(&pkt);
+  }
+}
+
+void slate::rewind()
+{
+  position = 0;
+}
+
+void slate::next(AVPacket *pkt, int64_t pts)
+{
+  av_packet_ref(pkt, packets[position % packets.size()]);
+  pkt->pts = pts;
+  pkt->dts = pts;
+
+  if (position == 0 && !extradata.empty())
+  {
+    // the live encoder has its own sps and pps, the flv muxer switches to ours in-band
+    uint8_t *side = av_packet_new_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, extradata.size());
+    if (side)
+    {
+      memcpy(side, extradata.data(), extradata.size());
+    }
+  }
+  position++;
+}
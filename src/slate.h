@@ -0,0 +1,39 @@
+#ifndef SLATE_H
+#define SLATE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+// a still picture encoded once into a single gop, replayed with new timestamps while the camera is
+// away so the outputs keep getting video without any encoding work
+class slate
+{
+public:
+  // encodes the gop with the opened encoder, which is not used afterwards
+  slate(AVCodecContext *encoder, const std::string &text);
+  ~slate();
+
+  int width() const { return frame_width; }
+  int height() const { return frame_height; }
+
+  // starts over at the keyframe, the next packet carries the slate's own sequence header
+  void rewind();
+
+  // references the next packet into pkt with pts and dts set to pts
+  void next(AVPacket *pkt, int64_t pts);
+
+private:
+  std::vector<AVPacket *> packets;
+  std::vector<uint8_t> extradata;
+  int frame_width;
+  int frame_height;
+  size_t position;
+};
+
+#endif
@@ -0,0 +1,293 @@
+#include "spool.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavutil/crc.h>
+}
+
+static const uint64_t spool_magic = 0x4c4f4f5053505452ULL;
+// records of the layout without extradata had 0x44524352, those are dropped on recovery
+static const uint32_t record_magic = 0x32524352;
+// the file header gets a page of its own, records follow it
+static const size_t header_size = 4096;
+
+struct spool_header
+{
+  uint64_t magic;
+  uint64_t capacity;
+  uint64_t uploaded;
+};
+
+struct record_header
+{
+  uint32_t magic;
+  // covers everything after it, the payload included
+  uint32_t crc;
+  uint64_t seq;
+  int32_t size;
+  int32_t stream_index;
+  int32_t media_type;
+  int32_t flags;
+  int32_t time_base_num;
+  int32_t time_base_den;
+  int64_t pts;
+  int64_t dts;
+  int64_t duration;
+  // new extradata side data, stored behind the packet
+  int32_t extradata_size;
+  int32_t reserved;
+};
+
+static size_t record_length(size_t payload)
+{
+  return (sizeof(record_header) + payload + 7) & ~static_cast<size_t>(7);
+}
+
+static uint32_t record_crc(const uint8_t *record, size_t payload)
+{
+  const AVCRC *table = av_crc_get_table(AV_CRC_32_IEEE_LE);
+  size_t skip = offsetof(record_header, seq);
+  return av_crc(table, 0, record + skip, sizeof(record_header) - skip + payload);
+}
+
+packet_spool::packet_spool(const std::string &path, size_t capacity)
+    : fd(-1), capacity(capacity), data(nullptr), first_seq(0), write_offset(header_size), recovered_records(0)
+{
+  // a spool of another size is started over, its records would not line up
+  fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  bool reuse = fd >= 0 && fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == capacity;
+  if (fd >= 0 && !reuse && (ftruncate(fd, 0) != 0 || ftruncate(fd, capacity) != 0))
+  {
+    close(fd);
+    fd = -1;
+  }
+
+  void *mapped = fd >= 0 && capacity > header_size ? mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+  if (mapped == MAP_FAILED)
+  {
+    std::cout << "Could not map the spool file " << path << "!" << std::endl;
+    exit(1);
+  }
+  data = static_cast<uint8_t *>(mapped);
+
+  spool_header *header = reinterpret_cast<spool_header *>(data);
+  if (reuse && header->magic == spool_magic && header->capacity == capacity)
+  {
+    recover();
+  }
+  else
+  {
+    memset(data, 0, header_size);
+    header->capacity = capacity;
+    header->uploaded = 0;
+    header->magic = spool_magic;
+  }
+}
+
+packet_spool::~packet_spool()
+{
+  msync(data, capacity, MS_SYNC);
+  munmap(data, capacity);
+  close(fd);
+}
+
+void packet_spool::recover()
+{
+  // every intact record is found by its magic and checksum, torn and overwritten ones are stepped over
+  std::vector<std::pair<uint64_t, index_entry>> found;
+  for (size_t offset = header_size; offset + sizeof(record_header) <= capacity;)
+  {
+    record_header h;
+    memcpy(&h, data + offset, sizeof(h));
+    size_t payload = static_cast<size_t>(h.size) + static_cast<size_t>(h.extradata_size);
+    size_t length = h.size >= 0 && h.extradata_size >= 0 ? record_length(payload) : 0;
+    if (h.magic == record_magic && length && offset + length <= capacity && record_crc(data + offset, payload) == h.crc)
+    {
+      found.push_back({h.seq, {offset, length, h.media_type == AVMEDIA_TYPE_VIDEO && (h.flags & AV_PKT_FLAG_KEY)}});
+      offset += length;
+    }
+    else
+    {
+      offset += 8;
+    }
+  }
+  if (found.empty())
+  {
+    return;
+  }
+
+  // the newest records and everything before them without a gap, older leftovers are stale
+  std::sort(found.begin(), found.end(), [](const std::pair<uint64_t, index_entry> &a, const std::pair<uint64_t, index_entry> &b) { return a.first < b.first; });
+  size_t start = found.size() - 1;
+  while (start > 0 && found[start - 1].first + 1 == found[start].first)
+  {
+    start--;
+  }
+  for (size_t i = start; i < found.size(); i++)
+  {
+    index.push_back(found[i].second);
+  }
+
+  first_seq = found[start].first;
+  write_offset = index.back().offset + index.back().length;
+  recovered_records = index.size();
+
+  spool_header *header = reinterpret_cast<spool_header *>(data);
+  header->uploaded = std::min<uint64_t>(header->uploaded, first_seq + index.size());
+}
+
+void packet_spool::evict_front()
+{
+  index.pop_front();
+  first_seq++;
+}
+
+uint64_t packet_spool::append(int stream_index, AVRational time_base, AVMediaType type, const AVPacket *pkt)
+{
+  std::lock_guard<std::mutex> l(lock);
+  uint64_t seq = first_seq + index.size();
+  // the parameter sets of a resize or the slate, a replay has to hand them to the muxer again
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+  size_t extradata_size = 0;
+#else
+  int extradata_size = 0;
+#endif
+  const uint8_t *extradata = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &extradata_size);
+  size_t payload = pkt->size + static_cast<size_t>(extradata ? extradata_size : 0);
+  size_t length = record_length(payload);
+  if (pkt->size < 0 || length > capacity - header_size)
+  {
+    return seq;
+  }
+
+  // records are never split, what is left behind the write position before wrapping is the oldest
+  if (write_offset + length > capacity)
+  {
+    while (!index.empty() && index.front().offset >= write_offset)
+    {
+      evict_front();
+    }
+    write_offset = header_size;
+  }
+  while (!index.empty() && index.front().offset >= write_offset && index.front().offset < write_offset + length)
+  {
+    evict_front();
+  }
+  // the magic goes in last, a record torn by a crash fails its checksum either way
+  uint8_t *record = data + write_offset;
+  record_header h = {0, 0, seq, pkt->size, stream_index, type, pkt->flags, time_base.num, time_base.den, pkt->pts, pkt->dts, pkt->duration, static_cast<int32_t>(payload - pkt->size), 0};
+  memcpy(record, &h, sizeof(h));
+  memcpy(record + sizeof(h), pkt->data, pkt->size);
+  if (h.extradata_size)
+  {
+    memcpy(record + sizeof(h) + pkt->size, extradata, h.extradata_size);
+  }
+  h.crc = record_crc(record, payload);
+  h.magic = record_magic;
+  memcpy(record, &h, offsetof(record_header, seq));
+
+  index.push_back({write_offset, length, type == AVMEDIA_TYPE_VIDEO && (pkt->flags & AV_PKT_FLAG_KEY)});
+  write_offset += length;
+  return seq;
+}
+
+bool packet_spool::read(uint64_t seq, int &stream_index, AVRational &time_base, AVPacket *pkt)
+{
+  std::lock_guard<std::mutex> l(lock);
+  if (seq < first_seq || seq >= first_seq + index.size())
+  {
+    return false;
+  }
+
+  const uint8_t *record = data + index[seq - first_seq].offset;
+  record_header h;
+  memcpy(&h, record, sizeof(h));
+  if (av_new_packet(pkt, h.size) < 0)
+  {
+    return false;
+  }
+  memcpy(pkt->data, record + sizeof(h), h.size);
+  if (h.extradata_size > 0)
+  {
+    uint8_t *side = av_packet_new_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, h.extradata_size);
+    if (side)
+    {
+      memcpy(side, record + sizeof(h) + h.size, h.extradata_size);
+    }
+  }
+  pkt->flags = h.flags;
+  pkt->pts = h.pts;
+  pkt->dts = h.dts;
+  pkt->duration = h.duration;
+  stream_index = h.stream_index;
+  time_base = {h.time_base_num, h.time_base_den};
+  return true;
+}
+
+uint64_t packet_spool::keyframe_before(uint64_t seq)
+{
+  std::lock_guard<std::mutex> l(lock);
+  uint64_t head = first_seq + index.size();
+  if (seq >= first_seq && !index.empty())
+  {
+    for (uint64_t i = std::min(seq, head - 1) + 1; i-- > first_seq;)
+    {
+      if (index[i - first_seq].keyframe)
+      {
+        return i;
+      }
+    }
+  }
+
+  for (uint64_t i = first_seq; i < head; i++)
+  {
+    if (index[i - first_seq].keyframe)
+    {
+      return i;
+    }
+  }
+  return head;
+}
+
+uint64_t packet_spool::head()
+{
+  std::lock_guard<std::mutex> l(lock);
+  return first_seq + index.size();
+}
+
+uint64_t packet_spool::tail()
+{
+  std::lock_guard<std::mutex> l(lock);
+  return first_seq;
+}
+
+void packet_spool::set_uploaded(uint64_t seq)
+{
+  std::lock_guard<std::mutex> l(lock);
+  spool_header *header = reinterpret_cast<spool_header *>(data);
+  header->uploaded = std::max<uint64_t>(header->uploaded, seq);
+}
+
+uint64_t packet_spool::uploaded()
+{
+  std::lock_guard<std::mutex> l(lock);
+  return reinterpret_cast<spool_header *>(data)->uploaded;
+}
+
+void packet_spool::flush()
+{
+  msync(data, capacity, MS_ASYNC);
+}
@@ -0,0 +1,68 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+// an append-only log of encoded packets in a memory mapped file, wrapping around to the start when it
+// is full. every record carries a checksum, so after a crash the file is scanned and whatever is intact
+// is picked up again, together with how far the upload had got
+class packet_spool
+{
+public:
+  packet_spool(const std::string &path, size_t capacity);
+  ~packet_spool();
+
+  // returns the sequence number of the record, pkt is in time_base
+  uint64_t append(int stream_index, AVRational time_base, AVMediaType type, const AVPacket *pkt);
+
+  // false if seq is not written yet or already overwritten
+  bool read(uint64_t seq, int &stream_index, AVRational &time_base, AVPacket *pkt);
+
+  // the video keyframe a consumer starting at seq has to begin with, the oldest one stored if seq is gone
+  uint64_t keyframe_before(uint64_t seq);
+
+  // the next sequence number and the oldest one still stored
+  uint64_t head();
+  uint64_t tail();
+
+  // everything before seq has been delivered, survives a crash
+  void set_uploaded(uint64_t seq);
+  uint64_t uploaded();
+
+  // starts writing the dirty pages back, does not wait for it
+  void flush();
+
+  uint64_t recovered() const { return recovered_records; }
+
+private:
+  struct index_entry
+  {
+    size_t offset;
+    size_t length;
+    bool keyframe;
+  };
+
+  void recover();
+  void evict_front();
+
+  int fd;
+  size_t capacity;
+  uint8_t *data;
+
+  std::mutex lock;
+  std::deque<index_entry> index;
+  uint64_t first_seq;
+  size_t write_offset;
+  uint64_t recovered_records;
+};
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef STAGE_ERROR_H
+#define STAGE_ERROR_H
+
+#include <stdexcept>
+#include <string>
+
+// the part of a pipeline that failed, the supervisor in stream_video restarts only that part
+enum class pipeline_stage
+{
+  source,
+  encoder,
+  output
+};
+
+inline const char *stage_name(pipeline_stage stage)
+{
+  return stage == pipeline_stage::source ? "source" : stage == pipeline_stage::encoder ? "encoder" : "output";
+}
+
+// thrown by the pipeline helpers instead of exiting, the message is ready to print
+class stage_error : public std::runtime_error
+{
+public:
+  stage_error(pipeline_stage stage, const std::string &message) : std::runtime_error(message), stage(stage) {}
+
+  pipeline_stage stage;
+};
+
+#endif
@@ -0,0 +1,262 @@
+#include "supervisor.h"
+#include "frame-clock.h"
+#include "topology.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const uint32_t stats_magic = 0x54534b57;
+static const uint32_t stats_version = 1;
+static const size_t stats_slot_size = 128;
+// a worker that ran this long is healthy again, its next crash restarts it without a pause
+static const int64_t healthy_run_us = 60000000;
+static const int64_t max_restart_delay_us = 30000000;
+// a worker whose main loop did not come round for this long hangs somewhere below us and is killed
+static const int64_t hang_timeout_us = 10000000;
+static const int64_t report_interval_us = 10000000;
+
+stats_segment::stats_segment(const std::string &name, size_t workers) : name(name), workers(workers), bytes(0), base(nullptr)
+{
+  static_assert(sizeof(worker_stats) <= stats_slot_size, "worker stats have to fit in a slot");
+
+  bytes = stats_slot_size * (workers + 1);
+  void *mapped = MAP_FAILED;
+  if (name.empty())
+  {
+    mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  }
+  else
+  {
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0 && ftruncate(fd, bytes) == 0)
+    {
+      mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+  }
+  if (mapped == MAP_FAILED)
+  {
+    std::cout << "Could not create the stats segment " << name << "!" << std::endl;
+    exit(1);
+  }
+
+  // fresh mappings are zeroed, which is a valid state for every counter
+  base = static_cast<uint8_t *>(mapped);
+  stats_header *header = reinterpret_cast<stats_header *>(base);
+  header->version = stats_version;
+  header->workers = workers;
+  header->slot_size = stats_slot_size;
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = stats_magic;
+}
+
+stats_segment::~stats_segment()
+{
+  munmap(base, bytes);
+  if (!name.empty())
+  {
+    shm_unlink(name.c_str());
+  }
+}
+
+worker_stats *stats_segment::slot(size_t worker) const
+{
+  return reinterpret_cast<worker_stats *>(base + stats_slot_size * (worker + 1));
+}
+
+supervisor::supervisor(std::function<int(size_t)> run_worker, std::vector<std::vector<int>> cpus, stats_segment &stats, int shutdown_timeout_ms)
+    : run_worker(run_worker), cpus(cpus), stats(stats), shutdown_timeout_ms(shutdown_timeout_ms), workers(stats.size()), reported_us(0),
+      reported_frames(0), reported_bytes(0)
+{
+  this->cpus.resize(workers.size());
+  for (worker &w : workers)
+  {
+    w = {0, 0, 0, 0, false};
+  }
+}
+
+void supervisor::start(size_t index)
+{
+  worker &w = workers[index];
+  worker_stats *s = stats.slot(index);
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    std::cout << "Could not start worker " << index << ": " << strerror(errno) << std::endl;
+    w.restart_at_us = monotonic_time_us() + 1000000;
+    return;
+  }
+
+  if (pid == 0)
+  {
+    // a worker outliving its supervisor would hold on to the camera
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)
+    {
+      _exit(1);
+    }
+    // threads started from here on, the encoder's among them, inherit the set
+    if (!set_thread_affinity(cpus[index]))
+    {
+      std::cout << "Could not pin worker " << index << " to its CPUs!" << std::endl;
+    }
+    s->heartbeat_us.store(monotonic_time_us(), std::memory_order_relaxed);
+    int code = run_worker(index);
+    // skips the destructors of everything the supervisor had set up before forking
+    std::cout.flush();
+    _exit(code);
+  }
+
+  w.pid = pid;
+  w.started_us = monotonic_time_us();
+  s->pid.store(pid, std::memory_order_relaxed);
+  s->started_us.store(w.started_us, std::memory_order_relaxed);
+  s->heartbeat_us.store(w.started_us, std::memory_order_relaxed);
+}
+
+void supervisor::run(const volatile sig_atomic_t &stop)
+{
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    start(i);
+  }
+  reported_us = monotonic_time_us();
+
+  int64_t stopping_since_us = 0;
+  while (true)
+  {
+    int64_t now = monotonic_time_us();
+    if (stop && !stopping_since_us)
+    {
+      // the workers drain their outputs on SIGTERM
+      stopping_since_us = now;
+      for (worker &w : workers)
+      {
+        if (w.pid > 0)
+        {
+          kill(w.pid, SIGTERM);
+        }
+      }
+    }
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+      for (size_t i = 0; i < workers.size(); i++)
+      {
+        worker &w = workers[i];
+        if (w.pid != pid)
+        {
+          continue;
+        }
+        w.pid = 0;
+        stats.slot(i)->pid.store(0, std::memory_order_relaxed);
+        if (stopping_since_us)
+        {
+          continue;
+        }
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        {
+          // only a stop request ends a worker cleanly, it stays down
+          std::cout << "Worker " << i << " stopped" << std::endl;
+          w.finished = true;
+          continue;
+        }
+
+        w.quick_restarts = now - w.started_us >= healthy_run_us ? 0 : w.quick_restarts + 1;
+        int64_t delay_us = w.quick_restarts ? std::min(max_restart_delay_us, static_cast<int64_t>(1000000) << std::min(w.quick_restarts - 1, 5)) : 0;
+        w.restart_at_us = now + delay_us;
+        if (WIFSIGNALED(status))
+        {
+          std::cout << "Worker " << i << " died from signal " << WTERMSIG(status);
+        }
+        else
+        {
+          std::cout << "Worker " << i << " exited with code " << WEXITSTATUS(status);
+        }
+        std::cout << ", restarting it in " << delay_us / 1000 << " ms" << std::endl;
+      }
+    }
+
+    bool running = false;
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+      worker &w = workers[i];
+      worker_stats *s = stats.slot(i);
+      running = running || w.pid > 0;
+      if (stopping_since_us)
+      {
+        if (w.pid > 0 && now - stopping_since_us > shutdown_timeout_ms * 1000LL + 2000000)
+        {
+          kill(w.pid, SIGKILL);
+        }
+        continue;
+      }
+      if (w.pid > 0 && now - s->heartbeat_us.load(std::memory_order_relaxed) > hang_timeout_us)
+      {
+        std::cout << "Worker " << i << " hangs, killing it" << std::endl;
+        kill(w.pid, SIGKILL);
+        s->heartbeat_us.store(now, std::memory_order_relaxed);
+      }
+      if (!w.pid && !w.finished && now >= w.restart_at_us)
+      {
+        s->restarts.fetch_add(1, std::memory_order_relaxed);
+        start(i);
+        running = true;
+      }
+    }
+
+    if (stopping_since_us && !running)
+    {
+      break;
+    }
+    if (now - reported_us >= report_interval_us)
+    {
+      report(now);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+
+  report(monotonic_time_us());
+}
+
+void supervisor::report(int64_t now_us)
+{
+  size_t up = 0;
+  uint64_t frames = 0, bytes = 0, dropped = 0, restarts = 0;
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    const worker_stats *s = stats.slot(i);
+    up += workers[i].pid > 0;
+    frames += s->frames.load(std::memory_order_relaxed);
+    bytes += s->bytes.load(std::memory_order_relaxed);
+    dropped += s->dropped.load(std::memory_order_relaxed);
+    restarts += s->restarts.load(std::memory_order_relaxed);
+  }
+
+  // a restarted worker carries on from the counts its predecessor left in the slot
+  int64_t elapsed_us = std::max<int64_t>(1, now_us - reported_us);
+  std::cout << "Workers " << up << "/" << workers.size() << " up: " << (frames - reported_frames) * 1000000.0 / elapsed_us << " fps, "
+            << (bytes - reported_bytes) * 8000 / elapsed_us
+            << " kb/s, " << frames << " frames, " << dropped << " dropped, " << restarts << " restarts" << std::endl;
+  reported_us = now_us;
+  reported_frames = frames;
+  reported_bytes = bytes;
+}
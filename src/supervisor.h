@@ -0,0 +1,96 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include <atomic>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+// counters of one worker process, in a segment shared by the supervisor and all workers. workers only
+// store to their own slot with plain atomic stores, so publishing costs no syscall. the supervisor
+// fills in the first four fields, the worker the rest. all fields are little endian
+struct worker_stats
+{
+  std::atomic<int64_t> pid;
+  std::atomic<int64_t> camera;
+  std::atomic<int64_t> started_us;
+  std::atomic<uint64_t> restarts;
+  // monotonic time of the worker's last pass through its main loop
+  std::atomic<int64_t> heartbeat_us;
+  std::atomic<uint64_t> frames;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> dropped;
+  std::atomic<uint64_t> duplicated;
+  std::atomic<uint64_t> slate_frames;
+};
+
+struct stats_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t workers;
+  // bytes from one slot to the next, the first slot starts one slot size into the segment
+  uint32_t slot_size;
+};
+
+// the stats segment. with a name it is a POSIX shared memory segment outside tools can map, without
+// one an anonymous mapping only the supervisor and the workers it forks share
+class stats_segment
+{
+public:
+  stats_segment(const std::string &name, size_t workers);
+  ~stats_segment();
+
+  worker_stats *slot(size_t worker) const;
+  size_t size() const { return workers; }
+
+private:
+  std::string name;
+  size_t workers;
+  size_t bytes;
+  uint8_t *base;
+};
+
+// runs every worker in a process of its own, pinned to its CPU set. a worker that crashes, is killed or
+// stops sending heartbeats is started again after a pause that doubles with every restart in quick
+// succession. the supervisor itself does not start threads, so forking it is safe
+class supervisor
+{
+public:
+  // run_worker is called in the forked child, its return value is the exit code. empty CPU sets
+  // leave the worker unpinned
+  supervisor(std::function<int(size_t)> run_worker, std::vector<std::vector<int>> cpus, stats_segment &stats, int shutdown_timeout_ms);
+
+  // returns once stop is set and all workers have exited
+  void run(const volatile sig_atomic_t &stop);
+
+private:
+  struct worker
+  {
+    pid_t pid;
+    int64_t started_us;
+    int64_t restart_at_us;
+    // restarts since the worker last ran for a while
+    int quick_restarts;
+    bool finished;
+  };
+
+  void start(size_t index);
+  void report(int64_t now_us);
+
+  std::function<int(size_t)> run_worker;
+  std::vector<std::vector<int>> cpus;
+  stats_segment &stats;
+  int shutdown_timeout_ms;
+  std::vector<worker> workers;
+  int64_t reported_us;
+  uint64_t reported_frames;
+  uint64_t reported_bytes;
+};
+
+#endif
@@ -0,0 +1,213 @@
+#include "thread-pool.h"
+
+#include <algorithm>
+#include <exception>
+
+static thread_local int worker_index = -1;
+
+// counts outstanding tasks for the callers that wait on them
+struct latch
+{
+  std::mutex lock;
+  std::condition_variable done;
+  int remaining;
+
+  explicit latch(int count) : remaining(count) {}
+
+  void count_down()
+  {
+    std::lock_guard<std::mutex> l(lock);
+    if (--remaining == 0)
+    {
+      done.notify_all();
+    }
+  }
+
+  void wait()
+  {
+    std::unique_lock<std::mutex> l(lock);
+    done.wait(l, [this] { return remaining == 0; });
+  }
+};
+
+work_stealing_pool::work_stealing_pool(size_t threads) : queued(0), running(true)
+{
+  if (threads == 0)
+  {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  for (size_t i = 0; i < threads; i++)
+  {
+    queues.emplace_back(new task_queue());
+  }
+  for (size_t i = 0; i < threads; i++)
+  {
+    workers.emplace_back(&work_stealing_pool::work, this, i);
+  }
+}
+
+work_stealing_pool::~work_stealing_pool()
+{
+  {
+    std::lock_guard<std::mutex> l(idle_lock);
+    running = false;
+  }
+  wake.notify_all();
+  for (auto &worker : workers)
+  {
+    worker.join();
+  }
+}
+
+int work_stealing_pool::current_worker()
+{
+  return worker_index;
+}
+
+void work_stealing_pool::submit(size_t pipeline, std::function<void()> task)
+{
+  push(pipeline % queues.size(), pipeline, std::move(task));
+}
+
+void work_stealing_pool::push(size_t index, size_t pipeline, std::function<void()> task)
+{
+  task_queue &q = *queues[index];
+  {
+    std::lock_guard<std::mutex> l(q.lock);
+    std::deque<std::function<void()>> &tasks = q.pipelines[pipeline];
+    if (tasks.empty())
+    {
+      q.ready.push_back(pipeline);
+    }
+    tasks.push_back(std::move(task));
+  }
+
+  {
+    std::lock_guard<std::mutex> l(idle_lock);
+    queued++;
+  }
+  wake.notify_one();
+}
+
+void work_stealing_pool::run(size_t pipeline, const std::function<void()> &task)
+{
+  // errors surface on the calling thread, a worker must never die with them
+  std::exception_ptr error;
+  latch finished(1);
+  submit(pipeline, [&] {
+    try
+    {
+      task();
+    }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+    finished.count_down();
+  });
+  finished.wait();
+
+  if (error)
+  {
+    std::rethrow_exception(error);
+  }
+}
+
+void work_stealing_pool::parallel_for(size_t pipeline, int count, const std::function<void(int)> &fn)
+{
+  if (count <= 0)
+  {
+    return;
+  }
+
+  latch finished(count - 1);
+  for (int i = 1; i < count; i++)
+  {
+    // spread the slices over neighbouring queues so they start in parallel without stealing
+    push((pipeline + i) % queues.size(), pipeline, [&fn, &finished, i] {
+      fn(i);
+      finished.count_down();
+    });
+  }
+
+  fn(0);
+  finished.wait();
+}
+
+bool work_stealing_pool::try_pop(size_t index, std::function<void()> &task)
+{
+  // own queue first, the oldest task of the pipeline whose turn it is. it goes to the back of the
+  // line if it has more
+  {
+    task_queue &q = *queues[index];
+    std::lock_guard<std::mutex> l(q.lock);
+    if (!q.ready.empty())
+    {
+      size_t pipeline = q.ready.front();
+      q.ready.pop_front();
+      auto tasks = q.pipelines.find(pipeline);
+      task = std::move(tasks->second.front());
+      tasks->second.pop_front();
+      if (tasks->second.empty())
+      {
+        q.pipelines.erase(tasks);
+      }
+      else
+      {
+        q.ready.push_back(pipeline);
+      }
+      return true;
+    }
+  }
+
+  // then steal the newest task of someone else, from the pipeline served last, the owner keeps
+  // working through the older ones
+  for (size_t i = 1; i < queues.size(); i++)
+  {
+    task_queue &q = *queues[(index + i) % queues.size()];
+    std::lock_guard<std::mutex> l(q.lock);
+    if (!q.ready.empty())
+    {
+      size_t pipeline = q.ready.back();
+      auto tasks = q.pipelines.find(pipeline);
+      task = std::move(tasks->second.back());
+      tasks->second.pop_back();
+      if (tasks->second.empty())
+      {
+        q.pipelines.erase(tasks);
+        q.ready.pop_back();
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void work_stealing_pool::work(size_t index)
+{
+  worker_index = static_cast<int>(index);
+
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> l(idle_lock);
+      wake.wait(l, [this] { return queued > 0 || !running; });
+      // queued tasks still run when stopping, someone may be waiting on them
+      if (queued == 0)
+      {
+        return;
+      }
+      // claim one task, there is always at least one queued per claim
+      queued--;
+    }
+
+    std::function<void()> task;
+    while (!try_pop(index, task))
+    {
+      std::this_thread::yield();
+    }
+    task();
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// one queue per worker. tasks go to the home queue of their pipeline and run there in order, idle
+// workers steal from the far end of the other queues. within a queue every pipeline has a fifo of its
+// own and the pipelines are served round robin, so pipelines sharing a home queue take turns and a
+// busy camera cannot starve the others
+class work_stealing_pool
+{
+public:
+  // 0 sizes the pool to the machine
+  explicit work_stealing_pool(size_t threads = 0);
+  // runs whatever is still queued before the workers exit, callers may be waiting on it
+  ~work_stealing_pool();
+
+  void submit(size_t pipeline, std::function<void()> task);
+
+  // runs the task on the pool and waits for it, rethrows what the task threw
+  void run(size_t pipeline, const std::function<void()> &task);
+
+  // runs fn(0) .. fn(count - 1) and waits for all of them, fn(0) on the calling thread. must not be
+  // called from inside a pool task
+  void parallel_for(size_t pipeline, int count, const std::function<void(int)> &fn);
+
+  size_t size() const { return queues.size(); }
+
+  // index of the pool worker running the calling thread, -1 outside the pool
+  static int current_worker();
+
+private:
+  struct task_queue
+  {
+    std::mutex lock;
+    std::map<size_t, std::deque<std::function<void()>>> pipelines;
+    // pipelines with tasks waiting, the front one is served next
+    std::deque<size_t> ready;
+  };
+
+  void push(size_t index, size_t pipeline, std::function<void()> task);
+  bool try_pop(size_t index, std::function<void()> &task);
+  void work(size_t index);
+
+  std::vector<std::unique_ptr<task_queue>> queues;
+  std::vector<std::thread> workers;
+  std::mutex idle_lock;
+  std::condition_variable wake;
+  size_t queued;
+  bool running;
+};
+
+#endif
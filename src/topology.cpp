@@ -0,0 +1,360 @@
+#include "topology.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <tuple>
+
+#include <sched.h>
+
+static const std::string sysfs_cpu = "/sys/devices/system/cpu/cpu";
+
+bool parse_cpu_list(const std::string &spec, std::vector<int> &cpus)
+{
+  cpus.clear();
+  size_t pos = 0;
+  while (pos < spec.size())
+  {
+    size_t comma = spec.find(',', pos);
+    std::string range = spec.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+    pos = comma == std::string::npos ? spec.size() : comma + 1;
+
+    char *end;
+    long first = strtol(range.c_str(), &end, 10), last = first;
+    if (end == range.c_str())
+    {
+      return false;
+    }
+    if (*end == '-')
+    {
+      const char *from = end + 1;
+      last = strtol(from, &end, 10);
+      if (end == from)
+      {
+        return false;
+      }
+    }
+    // sysfs ends its lists with a newline
+    if (*end && *end != '\n')
+    {
+      return false;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE)
+    {
+      return false;
+    }
+    for (int cpu = static_cast<int>(first); cpu <= last; cpu++)
+    {
+      cpus.push_back(cpu);
+    }
+  }
+  return !cpus.empty();
+}
+
+static bool read_sysfs(const std::string &path, std::string &value)
+{
+  std::ifstream file(path);
+  return static_cast<bool>(std::getline(file, value));
+}
+
+static int read_sysfs_int(const std::string &path, int fallback)
+{
+  std::string value;
+  return read_sysfs(path, value) ? atoi(value.c_str()) : fallback;
+}
+
+std::vector<cpu_info> read_cpu_topology()
+{
+  std::vector<cpu_info> topology;
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+  {
+    return topology;
+  }
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+  {
+    if (!CPU_ISSET(cpu, &allowed))
+    {
+      continue;
+    }
+
+    // without sysfs every CPU is a core of its own in a single package
+    std::string dir = sysfs_cpu + std::to_string(cpu);
+    cpu_info info = {cpu, read_sysfs_int(dir + "/topology/physical_package_id", 0), read_sysfs_int(dir + "/topology/core_id", cpu), cpu, -1};
+    for (int index = 0;; index++)
+    {
+      std::string cache = dir + "/cache/index" + std::to_string(index);
+      std::string type, shared;
+      if (!read_sysfs(cache + "/type", type))
+      {
+        break;
+      }
+      std::vector<int> sharing;
+      if (type == "Instruction" || !read_sysfs(cache + "/shared_cpu_list", shared) || !parse_cpu_list(shared, sharing))
+      {
+        continue;
+      }
+      int level = read_sysfs_int(cache + "/level", 0);
+      if (level == 2)
+      {
+        info.l2 = sharing[0];
+      }
+      else if (level == 3)
+      {
+        info.l3 = sharing[0];
+      }
+    }
+    if (info.l3 < 0)
+    {
+      // no L3 reported, the package is the closest thing
+      info.l3 = -1 - info.package;
+    }
+    topology.push_back(info);
+  }
+
+  std::sort(topology.begin(), topology.end(), [](const cpu_info &a, const cpu_info &b) {
+    return std::make_tuple(a.package, a.l3, a.l2, a.core, a.id) < std::make_tuple(b.package, b.l3, b.l2, b.core, b.id);
+  });
+  return topology;
+}
+
+// the hyperthreads of each core in topology order, grouped by L3
+static std::vector<std::vector<std::vector<int>>> cores_by_l3(const std::vector<cpu_info> &topology)
+{
+  std::vector<std::vector<std::vector<int>>> domains;
+  for (size_t i = 0; i < topology.size(); i++)
+  {
+    const cpu_info &c = topology[i];
+    bool new_domain = i == 0 || c.package != topology[i - 1].package || c.l3 != topology[i - 1].l3;
+    bool new_core = new_domain || c.core != topology[i - 1].core || c.l2 != topology[i - 1].l2;
+    if (new_domain)
+    {
+      domains.emplace_back();
+    }
+    if (new_core)
+    {
+      domains.back().emplace_back();
+    }
+    domains.back().back().push_back(c.id);
+  }
+  return domains;
+}
+
+std::vector<std::vector<int>> plan_pipeline_cpus(const std::vector<cpu_info> &topology, size_t pipelines)
+{
+  std::vector<std::vector<int>> sets(pipelines);
+  std::vector<std::vector<std::vector<int>>> domains = cores_by_l3(topology);
+  if (domains.empty() || !pipelines)
+  {
+    return sets;
+  }
+
+  if (pipelines <= domains.size())
+  {
+    // a home L3 each, spread over the packages and listed first in the set. the spare L3s go to the
+    // pipeline homed closest below them on the same package, or above them when there is none, so the
+    // encoders use the whole package while the frame handoffs stay in the home L3. a package without a
+    // pipeline stays idle, frames would cross sockets
+    std::vector<size_t> homes(pipelines);
+    for (size_t p = 0; p < pipelines; p++)
+    {
+      homes[p] = p * domains.size() / pipelines;
+    }
+    auto package = [&](size_t d) {
+      int id = domains[d].front().front();
+      for (const cpu_info &c : topology)
+      {
+        if (c.id == id)
+        {
+          return c.package;
+        }
+      }
+      return -1;
+    };
+    std::vector<size_t> order(homes);
+    for (size_t d = 0; d < domains.size(); d++)
+    {
+      if (std::find(homes.begin(), homes.end(), d) == homes.end())
+      {
+        order.push_back(d);
+      }
+    }
+    for (size_t d : order)
+    {
+      size_t below = pipelines, above = pipelines;
+      for (size_t p = 0; p < pipelines; p++)
+      {
+        if (package(homes[p]) != package(d))
+        {
+          continue;
+        }
+        if (homes[p] <= d)
+        {
+          below = p;
+        }
+        else if (above == pipelines)
+        {
+          above = p;
+        }
+      }
+      size_t owner = below < pipelines ? below : above;
+      if (owner < pipelines)
+      {
+        for (const std::vector<int> &core : domains[d])
+        {
+          sets[owner].insert(sets[owner].end(), core.begin(), core.end());
+        }
+      }
+    }
+    return sets;
+  }
+
+  // every L3 is shared by a run of pipelines, which split its cores
+  for (size_t d = 0; d < domains.size(); d++)
+  {
+    size_t first = d * pipelines / domains.size(), last = (d + 1) * pipelines / domains.size();
+    const std::vector<std::vector<int>> &cores = domains[d];
+    size_t count = last - first;
+    for (size_t p = first; p < last; p++)
+    {
+      size_t i = p - first;
+      if (cores.size() >= count)
+      {
+        for (size_t c = cores.size() * i / count; c < cores.size() * (i + 1) / count; c++)
+        {
+          sets[p].insert(sets[p].end(), cores[c].begin(), cores[c].end());
+        }
+      }
+      else
+      {
+        // more pipelines than cores, they take turns on the cores
+        sets[p] = cores[i % cores.size()];
+      }
+    }
+  }
+  return sets;
+}
+
+bool plan_stages(const std::vector<cpu_info> &topology, const std::vector<int> &cpus, const std::string &overrides, pipeline_affinity &affinity)
+{
+  affinity = {cpus, cpus, cpus, cpus, cpus};
+  if (cpus.empty())
+  {
+    return true;
+  }
+
+  std::vector<cpu_info> own;
+  for (const cpu_info &c : topology)
+  {
+    if (std::find(cpus.begin(), cpus.end(), c.id) != cpus.end())
+    {
+      own.push_back(c);
+    }
+  }
+  std::vector<std::vector<std::vector<int>>> domains = cores_by_l3(own);
+  if (!domains.empty())
+  {
+    // a set across several L3s keeps the handoffs within the one its first CPU is in, planned sets
+    // list their home L3 first
+    const std::vector<std::vector<int>> *home = &domains.front();
+    for (const std::vector<std::vector<int>> &domain : domains)
+    {
+      for (const std::vector<int> &core : domain)
+      {
+        if (std::find(core.begin(), core.end(), cpus.front()) != core.end())
+        {
+          home = &domain;
+        }
+      }
+    }
+    affinity.capture = affinity.convert = home->front();
+    affinity.network = home->back();
+  }
+
+  size_t pos = 0;
+  while (pos < overrides.size())
+  {
+    size_t semicolon = overrides.find(';', pos);
+    std::string entry = overrides.substr(pos, semicolon == std::string::npos ? std::string::npos : semicolon - pos);
+    pos = semicolon == std::string::npos ? overrides.size() : semicolon + 1;
+
+    size_t equals = entry.find('=');
+    std::vector<int> positions;
+    if (equals == std::string::npos || !parse_cpu_list(entry.substr(equals + 1), positions))
+    {
+      return false;
+    }
+    std::string stage = entry.substr(0, equals);
+    std::vector<int> *set = stage == "capture" ? &affinity.capture
+                            : stage == "convert" ? &affinity.convert
+                            : stage == "encode"  ? &affinity.encode
+                            : stage == "network" ? &affinity.network
+                                                 : nullptr;
+    if (!set)
+    {
+      return false;
+    }
+    set->clear();
+    for (int p : positions)
+    {
+      if (p >= static_cast<int>(cpus.size()))
+      {
+        return false;
+      }
+      set->push_back(cpus[p]);
+    }
+  }
+  return true;
+}
+
+static bool get_thread_affinity(std::vector<int> &cpus)
+{
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) < 0)
+  {
+    return false;
+  }
+  cpus.clear();
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+  {
+    if (CPU_ISSET(cpu, &set))
+    {
+      cpus.push_back(cpu);
+    }
+  }
+  return true;
+}
+
+bool set_thread_affinity(const std::vector<int> &cpus)
+{
+  if (cpus.empty())
+  {
+    return true;
+  }
+
+  // pid 0 is the calling thread, not the whole process
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus)
+  {
+    CPU_SET(cpu, &set);
+  }
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+scoped_affinity::scoped_affinity(const std::vector<int> &cpus) : pinned(false)
+{
+  if (!cpus.empty() && get_thread_affinity(previous))
+  {
+    pinned = set_thread_affinity(cpus);
+  }
+}
+
+scoped_affinity::~scoped_affinity()
+{
+  if (pinned)
+  {
+    set_thread_affinity(previous);
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <string>
+#include <vector>
+
+// "0-3,8,10-11" as used by the kernel
+bool parse_cpu_list(const std::string &spec, std::vector<int> &cpus);
+
+// where a CPU sits in the cache hierarchy. caches are identified by the lowest CPU sharing them
+struct cpu_info
+{
+  int id;
+  int package;
+  int core;
+  int l2;
+  int l3;
+};
+
+// the CPUs this process may run on, from /sys/devices/system/cpu. ordered so that hyperthreads of a
+// core, then cores sharing an L2, then an L3, then a package are next to each other
+std::vector<cpu_info> read_cpu_topology();
+
+// CPUs of one pipeline and of its stages, empty sets leave threads where they are
+struct pipeline_affinity
+{
+  std::vector<int> cpus;
+  // the camera's reader threads
+  std::vector<int> capture;
+  // the pipeline's own thread, which converts, filters and feeds the encoder
+  std::vector<int> convert;
+  // the encoder's threads
+  std::vector<int> encode;
+  // reconnects, catch-up uploads and audio
+  std::vector<int> network;
+};
+
+// splits the CPUs between the pipelines in whole cores. with fewer pipelines than L3s each gets a home
+// L3, listed first, and the spare L3s of its package. with more the pipelines are spread evenly over
+// the L3s and split their cores
+std::vector<std::vector<int>> plan_pipeline_cpus(const std::vector<cpu_info> &topology, size_t pipelines);
+
+// places the stages within a pipeline's CPUs. capture and convert share the first core so frames are
+// handed over in its caches, network goes to the last core in the same L3 and the encoder gets all
+// of them, across L3s if the set spans several.
+// overrides like "capture=0;encode=1-3" give stages positions within the pipeline's CPUs instead
+bool plan_stages(const std::vector<cpu_info> &topology, const std::vector<int> &cpus, const std::string &overrides, pipeline_affinity &affinity);
+
+// pins the calling thread, threads it starts afterwards inherit the set
+bool set_thread_affinity(const std::vector<int> &cpus);
+
+// pins the calling thread while in scope, so that threads started meanwhile land on the set
+class scoped_affinity
+{
+public:
+  explicit scoped_affinity(const std::vector<int> &cpus);
+  ~scoped_affinity();
+
+private:
+  bool pinned;
+  std::vector<int> previous;
+};
+
+#endif